@@ -0,0 +1,246 @@
+// BatchRunner
+// Runs many image sequences in one process, reusing the image processors between them
+#include "batch_runner.h"
+
+#include <algorithm>
+#include <exception>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <system_error>
+#include <omp.h>
+
+namespace
+{
+    const std::string kDefaultOutputDirectory = "vanish";
+    const std::string kSubdirectoryPattern = "/*";
+}
+
+std::vector<BatchJob> readManifest(const std::string& fn)
+{
+    std::ifstream manifest(fn);
+
+    if (!manifest)
+    {
+        std::cerr << "Batch manifest " << fn << " not found! Terminating." << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    std::vector<BatchJob> jobs;
+    std::string line;
+
+    while (std::getline(manifest, line))
+    {
+        std::istringstream fields(line);
+        std::string input;
+        std::string output;
+
+        if (!(fields >> input) || input[0] == '#')
+        {
+            continue;
+        }
+
+        fields >> output;
+
+        // Every subdirectory of a directory ending in /* is a job of its own
+        if (input.size() > kSubdirectoryPattern.size() && input.compare(input.size() - kSubdirectoryPattern.size(), kSubdirectoryPattern.size(), kSubdirectoryPattern) == 0)
+        {
+            std::filesystem::path parent(input.substr(0, input.size() - kSubdirectoryPattern.size()));
+            std::vector<std::filesystem::path> directories;
+
+            if (std::filesystem::is_directory(parent))
+            {
+                for (std::filesystem::directory_iterator itr(parent); itr != std::filesystem::directory_iterator(); ++itr)
+                {
+                    if (std::filesystem::is_directory(*itr))
+                    {
+                        directories.push_back(itr->path());
+                    }
+                }
+            }
+
+            std::sort(directories.begin(), directories.end());
+
+            for (const auto& directory : directories)
+            {
+                BatchJob job;
+                job.inputDirectory = directory.string();
+                job.outputDirectory = output.empty() ? (directory / kDefaultOutputDirectory).string() : (std::filesystem::path(output) / directory.filename()).string();
+                jobs.push_back(job);
+            }
+
+            continue;
+        }
+
+        BatchJob job;
+        job.inputDirectory = input;
+        job.outputDirectory = output.empty() ? (std::filesystem::path(input) / kDefaultOutputDirectory).string() : output;
+        jobs.push_back(job);
+    }
+
+    return jobs;
+}
+
+// Sequences that run side by side share the decoder threads and the memory budgets
+BatchRunner::BatchRunner(const ProcessorSettings& processorSettings, const std::string& extension, int concurrentJobs)
+    : settings(processorSettings)
+    , fileExtension(extension)
+    , jobs(std::max(concurrentJobs, 1))
+{
+    settings.headless = true;
+
+    if (jobs > 1)
+    {
+        settings.decoderThreads /= jobs;
+        settings.memoryBudget /= jobs;
+        settings.maxMemory /= jobs;
+    }
+}
+
+BatchRunner::~BatchRunner()
+{
+}
+
+// Jobs are handed out to the OpenMP threads as they become free. Each worker keeps its
+// processors, so the bucket counters and pass buffers are only reallocated when a job needs
+// more memory than any job before it on the same worker.
+int BatchRunner::run(const std::vector<BatchJob>& batchJobs)
+{
+    int jobCount = static_cast<int>(batchJobs.size());
+    int workerCount = std::max(std::min(jobs, jobCount), 1);
+
+    std::vector<std::unique_ptr<Worker>> workers;
+
+    for (int i = 0; i < workerCount; i++)
+    {
+        workers.emplace_back(new Worker());
+    }
+
+    int failed = 0;
+    int finished = 0;
+
+    // With several jobs at once, every job runs its passes on its own thread
+    omp_set_max_active_levels(1);
+
+#pragma omp parallel for schedule(dynamic) num_threads(workerCount) reduction(+ : failed)
+    for (int job = 0; job < jobCount; job++)
+    {
+        std::unique_ptr<Worker>& worker = workers[omp_get_thread_num()];
+        bool succeeded = runJob(*worker, batchJobs[job]);
+
+        // A job that failed halfway may leave its processor in any state, so the next job gets new ones
+        if (!succeeded)
+        {
+            failed++;
+            worker.reset(new Worker());
+        }
+
+#pragma omp critical
+        {
+            finished++;
+            std::cout << std::endl << "Job " << finished << "/" << jobCount << ": " << batchJobs[job].inputDirectory
+                << (succeeded ? " -> " + batchJobs[job].outputDirectory : " failed") << std::endl;
+        }
+    }
+
+    return failed;
+}
+
+// Process one sequence with the processor matching its counter width. Errors of the sequence,
+// such as a frame that cannot be read, only fail this job.
+bool BatchRunner::runJob(Worker& worker, const BatchJob& job)
+{
+    std::vector<std::string> fileNames = findFrameFiles(job.inputDirectory, fileExtension);
+
+    if (fileNames.size() < 2)
+    {
+        std::cerr << "Not enough files found in directory " << job.inputDirectory << "! Skipping." << std::endl;
+        return false;
+    }
+
+    std::error_code error;
+    std::filesystem::create_directories(job.outputDirectory, error);
+
+    if (error)
+    {
+        std::cerr << "Could not create output directory " << job.outputDirectory << "! Skipping." << std::endl;
+        return false;
+    }
+
+    // Images deeper than 8 bits are read as 16-bit samples
+    try
+    {
+        if (settings.depth > 8)
+        {
+            runJob(worker.deep, job, fileNames);
+        }
+        else
+        {
+            runJob(worker.shallow, job, fileNames);
+        }
+    }
+    catch (const std::exception& error)
+    {
+        std::cerr << std::endl << "Sequence " << job.inputDirectory << " failed: " << error.what() << " Skipping." << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+template <typename PixelType>
+void BatchRunner::runJob(Processors<PixelType>& processors, const BatchJob& job, const std::vector<std::string>& fileNames)
+{
+    int countedFrames = static_cast<int>(fileNames.size());
+
+    if (settings.window > 0)
+    {
+        countedFrames = std::min(countedFrames, settings.window);
+    }
+
+    int counterBits = processorCounterBits(countedFrames);
+
+    if (counterBits == 8)
+    {
+        runSequence(processors.processor8, job, fileNames);
+    }
+    else if (counterBits == 16)
+    {
+        runSequence(processors.processor16, job, fileNames);
+    }
+    else
+    {
+        runSequence(processors.processor32, job, fileNames);
+    }
+}
+
+template <typename CountType, typename PixelType>
+void BatchRunner::runSequence(ImageProcessor<CountType, PixelType>& processor, const BatchJob& job, const std::vector<std::string>& fileNames)
+{
+    processor.setSettings(settings);
+    processor.setQuiet(jobs > 1);
+    processor.setOutputDirectory(job.outputDirectory);
+
+    // Every sequence keeps its frame stack and metrics next to its output images
+    if (!settings.frameStack.empty())
+    {
+        processor.setFrameStack((std::filesystem::path(job.outputDirectory) / std::filesystem::path(settings.frameStack).filename()).string());
+    }
+
+    if (!settings.metricsFile.empty())
+    {
+        processor.setMetricsFile((std::filesystem::path(job.outputDirectory) / std::filesystem::path(settings.metricsFile).filename()).string());
+    }
+
+    processor.setFiles(fileNames);
+
+    if (settings.window > 0)
+    {
+        processor.processWindow(settings.window);
+    }
+    else
+    {
+        processor.processSequence();
+    }
+}
@@ -0,0 +1,59 @@
+// BatchRunner
+// Runs many image sequences in one process, reusing the image processors between them
+
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "image_processor.h"
+
+// One sequence of a batch and the directory its output images are written to
+struct BatchJob {
+    std::string inputDirectory;
+    std::string outputDirectory;
+};
+
+// Read a manifest with one job per line: the input directory, optionally followed by the output directory.
+// An input directory ending in /* adds a job for every subdirectory. Without an output directory
+// the images are written to a vanish directory inside the input directory.
+// Empty lines and lines starting with # are skipped.
+std::vector<BatchJob> readManifest(const std::string& fn);
+
+class BatchRunner {
+public:
+    BatchRunner(const ProcessorSettings& processorSettings, const std::string& extension, int concurrentJobs);
+    ~BatchRunner();
+
+    // Run every job and return the number of jobs that failed
+    int run(const std::vector<BatchJob>& batchJobs);
+
+private:
+    // Processors of one worker for every counter width, reused from job to job
+    template <typename PixelType>
+    struct Processors {
+        ImageProcessor<std::uint8_t, PixelType> processor8;
+        ImageProcessor<std::uint16_t, PixelType> processor16;
+        ImageProcessor<std::uint32_t, PixelType> processor32;
+    };
+
+    // Only the processors of the bit depth of the batch are ever used
+    struct Worker {
+        Processors<std::uint8_t> shallow;
+        Processors<std::uint16_t> deep;
+    };
+
+    bool runJob(Worker& worker, const BatchJob& job);
+
+    template <typename PixelType>
+    void runJob(Processors<PixelType>& processors, const BatchJob& job, const std::vector<std::string>& fileNames);
+
+    template <typename CountType, typename PixelType>
+    void runSequence(ImageProcessor<CountType, PixelType>& processor, const BatchJob& job, const std::vector<std::string>& fileNames);
+
+    ProcessorSettings settings;
+    std::string fileExtension;
+    int jobs = 1;
+};
@@ -0,0 +1,483 @@
+// Bench
+// Time the pipeline stages on a generated sequence with a known background,
+// and report the reconstruction error next to the throughput
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <cxxopts.hpp>
+
+#include "image_processor.h"
+
+namespace
+{
+    const int kDefaultWidth = 1920;
+    const int kDefaultHeight = 1080;
+    const int kDefaultFrames = 32;
+    const int kDefaultChannels = 3;
+    const int kDefaultBitDepth = 8;
+    const int kDefaultBucketSize = 8;
+    const int kDefaultSprites = 12;
+    const float kDefaultNoise = 2.0f;
+    const int kDefaultRuns = 3;
+    const unsigned int kDefaultSeed = 1;
+
+    // Sprite sizes as a fraction of the image width, and speeds in widths per sequence
+    const float kMinSpriteSize = 0.04f;
+    const float kMaxSpriteSize = 0.12f;
+    const float kMinSpriteSpeed = 0.5f;
+    const float kMaxSpriteSpeed = 2.0f;
+
+    const double kMegapixel = 1.0e6;
+    const double kMegabyte = 1024.0 * 1024.0;
+
+    const std::string kCmdHelp = "help";
+    const std::string kCmdWidth = "width";
+    const std::string kCmdHeight = "height";
+    const std::string kCmdFrames = "frames";
+    const std::string kCmdChannels = "channels";
+    const std::string kCmdDepth = "depth";
+    const std::string kCmdSprites = "sprites";
+    const std::string kCmdNoise = "noise";
+    const std::string kCmdRuns = "runs";
+    const std::string kCmdSeed = "seed";
+    const std::string kCmdBucketSums = "bucket-sums";
+    const std::string kCmdClusters = "clusters";
+
+    struct SequenceSettings {
+        int width = kDefaultWidth;
+        int height = kDefaultHeight;
+        int frames = kDefaultFrames;
+        int channels = kDefaultChannels;
+        int depth = kDefaultBitDepth;
+        int sprites = kDefaultSprites;
+        float noise = kDefaultNoise;
+        unsigned int seed = kDefaultSeed;
+    };
+
+    struct Sprite {
+        float x = 0.0f;
+        float y = 0.0f;
+        float dx = 0.0f;
+        float dy = 0.0f;
+        int width = 0;
+        int height = 0;
+        std::vector<int> color;
+    };
+
+    // A static background with rectangular sprites moving across it and Gaussian noise on top.
+    // The frames are generated once and kept in memory, planar like decoded files,
+    // so the stages are timed without any decoding.
+    template <typename PixelType>
+    class SyntheticSequence {
+    public:
+        explicit SyntheticSequence(const SequenceSettings& settings)
+            : width(settings.width)
+            , height(settings.height)
+            , channels(settings.channels)
+            , frames(settings.frames)
+        {
+            std::mt19937 random(settings.seed);
+            int maxVal = (1 << settings.depth) - 1;
+            std::size_t size = static_cast<std::size_t>(width) * height;
+
+            // Smooth gradients with a gentle ripple, different for every channel
+            background.resize(size * channels);
+
+            for (int channel = 0; channel < channels; channel++)
+            {
+                for (int y = 0; y < height; y++)
+                {
+                    for (int x = 0; x < width; x++)
+                    {
+                        float u = static_cast<float>(x) / width;
+                        float v = static_cast<float>(y) / height;
+                        float ripple = 0.1f * std::sin(12.0f * u + 3.0f * channel) * std::cos(8.0f * v);
+                        float level = 0.15f + 0.35f * u + 0.25f * v * (channel + 1) / channels + ripple;
+
+                        background[x + y * width + channel * size] = static_cast<PixelType>(std::clamp(level, 0.0f, 1.0f) * maxVal);
+                    }
+                }
+            }
+
+            std::uniform_real_distribution<float> spriteSize(kMinSpriteSize, kMaxSpriteSize);
+            std::uniform_real_distribution<float> spriteSpeed(kMinSpriteSpeed, kMaxSpriteSpeed);
+            std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+            std::uniform_int_distribution<int> color(0, maxVal);
+            std::vector<Sprite> sprites(settings.sprites);
+
+            for (auto& sprite : sprites)
+            {
+                float angle = unit(random) * 6.2831853f;
+                float speed = spriteSpeed(random) * width / std::max(frames, 1);
+
+                sprite.width = std::max(static_cast<int>(spriteSize(random) * width), 1);
+                sprite.height = std::max(static_cast<int>(spriteSize(random) * width), 1);
+                sprite.x = unit(random) * width;
+                sprite.y = unit(random) * height;
+                sprite.dx = speed * std::cos(angle);
+                sprite.dy = speed * std::sin(angle);
+
+                for (int channel = 0; channel < channels; channel++)
+                {
+                    sprite.color.push_back(color(random));
+                }
+            }
+
+            std::normal_distribution<float> noise(0.0f, settings.noise * (maxVal + 1) / 256.0f);
+            data.resize(frames);
+
+            for (int frame = 0; frame < frames; frame++)
+            {
+                std::vector<PixelType>& image = data[frame];
+                image = background;
+
+                // Sprites wrap around the edges, so every part of the image is crossed now and then
+                for (const auto& sprite : sprites)
+                {
+                    int left = static_cast<int>(std::floor(sprite.x + sprite.dx * frame));
+                    int top = static_cast<int>(std::floor(sprite.y + sprite.dy * frame));
+
+                    for (int j = 0; j < sprite.height; j++)
+                    {
+                        int y = ((top + j) % height + height) % height;
+
+                        for (int i = 0; i < sprite.width; i++)
+                        {
+                            int x = ((left + i) % width + width) % width;
+
+                            for (int channel = 0; channel < channels; channel++)
+                            {
+                                image[x + y * width + channel * size] = static_cast<PixelType>(sprite.color[channel]);
+                            }
+                        }
+                    }
+                }
+
+                if (settings.noise > 0.0f)
+                {
+                    for (auto& value : image)
+                    {
+                        int noisy = static_cast<int>(std::lround(value + noise(random)));
+                        value = static_cast<PixelType>(std::min(std::max(noisy, 0), maxVal));
+                    }
+                }
+            }
+        }
+
+        int frameCount() const
+        {
+            return frames;
+        }
+
+        const unsigned char* frame(int index) const
+        {
+            return reinterpret_cast<const unsigned char*>(data[index].data());
+        }
+
+        const std::vector<PixelType>& groundTruth() const
+        {
+            return background;
+        }
+
+        const int width;
+        const int height;
+        const int channels;
+
+    private:
+        int frames = 0;
+        std::vector<PixelType> background;
+        std::vector<std::vector<PixelType>> data;
+    };
+
+    // Hands the frames of a generated sequence to a processor without copying them
+    template <typename PixelType>
+    class SyntheticFrameSource : public FrameSource {
+    public:
+        explicit SyntheticFrameSource(const SyntheticSequence<PixelType>& frames)
+            : sequence(frames)
+        {
+        }
+
+        int frameCount() const override
+        {
+            return sequence.frameCount();
+        }
+
+        const unsigned char* readFrame(int index, std::vector<unsigned char>&) override
+        {
+            return sequence.frame(index);
+        }
+
+    private:
+        const SyntheticSequence<PixelType>& sequence;
+    };
+
+    // Difference between the reconstruction and the generated background, in input levels
+    struct ReconstructionError {
+        double meanAbsolute = 0.0;
+        double rootMeanSquare = 0.0;
+        double peakSignalToNoise = 0.0;
+        double wrongPixels = 0.0;
+    };
+
+    // The reconstruction always has three channels, a missing channel is left out.
+    // A pixel is wrong when any channel is off by more than a bucket.
+    template <typename PixelType>
+    ReconstructionError measureError(const SyntheticSequence<PixelType>& sequence, const std::vector<PixelType>& reconstruction, int depth, int bucketSize)
+    {
+        std::size_t size = static_cast<std::size_t>(sequence.width) * sequence.height;
+        int comparedChannels = std::min(sequence.channels, 3);
+        const std::vector<PixelType>& truth = sequence.groundTruth();
+
+        double absoluteSum = 0.0;
+        double squareSum = 0.0;
+        std::size_t wrong = 0;
+
+        for (std::size_t idx = 0; idx < size; idx++)
+        {
+            int worst = 0;
+
+            for (int channel = 0; channel < comparedChannels; channel++)
+            {
+                int difference = std::abs(static_cast<int>(reconstruction[idx + channel * size]) - static_cast<int>(truth[idx + channel * size]));
+
+                absoluteSum += difference;
+                squareSum += static_cast<double>(difference) * difference;
+                worst = std::max(worst, difference);
+            }
+
+            if (worst > bucketSize)
+            {
+                wrong++;
+            }
+        }
+
+        double samples = static_cast<double>(size) * comparedChannels;
+        double maxVal = static_cast<double>((1 << depth) - 1);
+
+        ReconstructionError error;
+        error.meanAbsolute = absoluteSum / samples;
+        error.rootMeanSquare = std::sqrt(squareSum / samples);
+        error.peakSignalToNoise = error.rootMeanSquare > 0.0 ? 20.0 * std::log10(maxVal / error.rootMeanSquare) : std::numeric_limits<double>::infinity();
+        error.wrongPixels = 100.0 * wrong / size;
+
+        return error;
+    }
+
+    // Stages that did not run, such as the passes of the cluster estimator, have no time and no rate
+    void printStage(const char* name, double seconds, double megapixels)
+    {
+        if (seconds <= 0.0)
+        {
+            std::cout << "\t" << name << std::setw(10) << "-" << "  " << std::setw(10) << "-" << std::endl;
+            return;
+        }
+
+        std::cout << "\t" << name << std::setw(10) << seconds << " s" << std::setw(10) << megapixels / seconds << " MP/s" << std::endl;
+    }
+
+    // Run the stages one after another on a fresh processor, keeping the best time of each stage over the runs
+    template <typename CountType, typename PixelType>
+    void runBench(const SequenceSettings& settings, int runs, bool bucketSums, Estimator estimator)
+    {
+        std::cout << "Generating " << settings.frames << " frames..." << std::flush;
+        SyntheticSequence<PixelType> sequence(settings);
+        std::cout << " done." << std::endl;
+
+        int bucketSize = kDefaultBucketSize << (settings.depth - kDefaultBitDepth);
+
+        ProcessorMetrics best;
+        ReconstructionError error;
+        std::vector<int> failed(2, 0);
+
+        for (int run = 0; run < runs; run++)
+        {
+            ImageProcessor<CountType, PixelType> processor;
+            processor.setQuiet(true);
+            processor.setDecoderThreads(0, 1);
+            processor.setBitDepth(settings.depth);
+            processor.setBucketSize(bucketSize);
+            processor.setBucketSums(bucketSums);
+            processor.setEstimator(estimator);
+            processor.setFrameSource(std::unique_ptr<FrameSource>(new SyntheticFrameSource<PixelType>(sequence)), settings.width, settings.height, settings.channels);
+
+            if (estimator == Estimator::Clusters)
+            {
+                processor.estimateClusters();
+            }
+            else
+            {
+                processor.countBuckets();
+                processor.findBiggestBucket();
+                processor.createFinal();
+            }
+
+            const ProcessorMetrics& metrics = processor.processingMetrics();
+
+            if (run == 0)
+            {
+                best = metrics;
+            }
+
+            best.countSeconds = std::min(best.countSeconds, metrics.countSeconds);
+            best.modeSeconds = std::min(best.modeSeconds, metrics.modeSeconds);
+            best.firstPassSeconds = std::min(best.firstPassSeconds, metrics.firstPassSeconds);
+            best.countFailedSeconds = std::min(best.countFailedSeconds, metrics.countFailedSeconds);
+            best.secondPassSeconds = std::min(best.secondPassSeconds, metrics.secondPassSeconds);
+            best.outputSeconds = std::min(best.outputSeconds, metrics.outputSeconds);
+
+            // Every run computes the same background, the last one is measured
+            if (run == runs - 1)
+            {
+                error = measureError(sequence, processor.background(), settings.depth, bucketSize);
+            }
+        }
+
+        double imageMegapixels = static_cast<double>(settings.width) * settings.height / kMegapixel;
+        double sequenceMegapixels = imageMegapixels * settings.frames;
+
+        std::cout << std::fixed << std::setprecision(3);
+        std::cout << std::endl << "Stages (best of " << runs << ")" << std::endl;
+        printStage("Count:      ", best.countSeconds, sequenceMegapixels);
+        printStage("Mode:       ", best.modeSeconds, imageMegapixels);
+        printStage("1st pass:   ", best.firstPassSeconds, sequenceMegapixels);
+        printStage("Fail count: ", best.countFailedSeconds, imageMegapixels);
+        printStage("2nd pass:   ", best.secondPassSeconds, sequenceMegapixels);
+        printStage("Output:     ", best.outputSeconds, imageMegapixels);
+
+        double total = best.countSeconds + best.modeSeconds + best.firstPassSeconds + best.countFailedSeconds + best.secondPassSeconds + best.outputSeconds;
+        printStage("Total:      ", total, sequenceMegapixels);
+        std::cout << "\tBuckets:    " << std::setw(10) << best.bucketBytes / kMegabyte << " MB" << std::endl;
+
+        std::cout << std::endl << "Reconstruction error" << std::endl;
+        std::cout << "\tMean:       " << std::setw(10) << error.meanAbsolute << std::endl;
+        std::cout << "\tRMS:        " << std::setw(10) << error.rootMeanSquare << std::endl;
+        std::cout << std::setprecision(2);
+        std::cout << "\tPSNR:       " << std::setw(10) << error.peakSignalToNoise << " dB" << std::endl;
+        std::cout << "\tWrong:      " << std::setw(10) << error.wrongPixels << " % of pixels off by more than a bucket" << std::endl;
+    }
+
+    template <typename PixelType>
+    void runBench(const SequenceSettings& settings, int runs, bool bucketSums, Estimator estimator)
+    {
+        switch (processorCounterBits(settings.frames))
+        {
+        case 8:
+            runBench<std::uint8_t, PixelType>(settings, runs, bucketSums, estimator);
+            break;
+        case 16:
+            runBench<std::uint16_t, PixelType>(settings, runs, bucketSums, estimator);
+            break;
+        default:
+            runBench<std::uint32_t, PixelType>(settings, runs, bucketSums, estimator);
+            break;
+        }
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    cxxopts::Options options("Bench", "Time the vanish pipeline stages on a generated image sequence.");
+    options.add_options("default")
+        (kCmdHelp, "show help message")
+        (kCmdWidth, "image width", cxxopts::value<int>()->default_value(std::to_string(kDefaultWidth)))
+        (kCmdHeight, "image height", cxxopts::value<int>()->default_value(std::to_string(kDefaultHeight)))
+        (kCmdFrames, "number of frames", cxxopts::value<int>()->default_value(std::to_string(kDefaultFrames)))
+        (kCmdChannels, "number of channels, 3 or 4", cxxopts::value<int>()->default_value(std::to_string(kDefaultChannels)))
+        (kCmdDepth, "channel bit depth, 8 to 16", cxxopts::value<int>()->default_value(std::to_string(kDefaultBitDepth)))
+        (kCmdSprites, "number of moving sprites", cxxopts::value<int>()->default_value(std::to_string(kDefaultSprites)))
+        (kCmdNoise, "standard deviation of the noise in 8-bit levels", cxxopts::value<float>()->default_value(std::to_string(kDefaultNoise)))
+        (kCmdRuns, "number of timed runs, the best time of each stage is reported", cxxopts::value<int>()->default_value(std::to_string(kDefaultRuns)))
+        (kCmdSeed, "random seed of the generator", cxxopts::value<unsigned int>()->default_value(std::to_string(kDefaultSeed)))
+        (kCmdBucketSums, "take the first pass from bucket sums kept while counting")
+        (kCmdClusters, "estimate the background from per-pixel clusters instead of bucket histograms");
+
+    auto arguments = options.parse(argc, argv);
+
+    if (arguments.count(kCmdHelp) > 0)
+    {
+        std::cout << options.help() << std::endl;
+        return EXIT_SUCCESS;
+    }
+
+    SequenceSettings settings;
+    settings.width = arguments[kCmdWidth].as<int>();
+    settings.height = arguments[kCmdHeight].as<int>();
+    settings.frames = arguments[kCmdFrames].as<int>();
+    settings.channels = arguments[kCmdChannels].as<int>();
+    settings.depth = arguments[kCmdDepth].as<int>();
+    settings.sprites = arguments[kCmdSprites].as<int>();
+    settings.noise = arguments[kCmdNoise].as<float>();
+    settings.seed = arguments[kCmdSeed].as<unsigned int>();
+    int runs = arguments[kCmdRuns].as<int>();
+    bool bucketSums = arguments.count(kCmdBucketSums) == 1;
+    Estimator estimator = arguments.count(kCmdClusters) == 1 ? Estimator::Clusters : Estimator::Buckets;
+
+    if (settings.width < 1 || settings.height < 1)
+    {
+        std::cerr << "Invalid image size. Using default value." << std::endl;
+        settings.width = kDefaultWidth;
+        settings.height = kDefaultHeight;
+    }
+
+    if (settings.frames < 1)
+    {
+        std::cerr << "Invalid number of frames. Using default value." << std::endl;
+        settings.frames = kDefaultFrames;
+    }
+
+    // The passes write three output channels, grayscale sequences are not supported
+    if (settings.channels < 3 || settings.channels > 4)
+    {
+        std::cerr << "Invalid number of channels. Using default value." << std::endl;
+        settings.channels = kDefaultChannels;
+    }
+
+    if (settings.depth < 8 || settings.depth > 16)
+    {
+        std::cerr << "Invalid bit depth. Using default value." << std::endl;
+        settings.depth = kDefaultBitDepth;
+    }
+
+    if (settings.sprites < 0)
+    {
+        std::cerr << "Invalid number of sprites. Using default value." << std::endl;
+        settings.sprites = kDefaultSprites;
+    }
+
+    if (settings.noise < 0.0f)
+    {
+        std::cerr << "Invalid noise level. Using default value." << std::endl;
+        settings.noise = kDefaultNoise;
+    }
+
+    if (runs < 1)
+    {
+        std::cerr << "Invalid number of runs. Using default value." << std::endl;
+        runs = kDefaultRuns;
+    }
+
+    std::cout << "Pipeline benchmark, " << settings.width << "x" << settings.height << ", " << settings.frames << " frames, "
+        << settings.channels << " channels, " << settings.depth << " bit, " << settings.sprites << " sprites" << std::endl;
+    std::cout << "Kernels: " << simdLevelName(simdLevel()) << std::endl << std::endl;
+
+    if (settings.depth > 8)
+    {
+        runBench<std::uint16_t>(settings, runs, bucketSums, estimator);
+    }
+    else
+    {
+        runBench<std::uint8_t>(settings, runs, bucketSums, estimator);
+    }
+
+    return EXIT_SUCCESS;
+}
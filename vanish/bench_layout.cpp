@@ -0,0 +1,108 @@
+// Bench Layout
+// Compare bucket counting and mode finding with the bucket-major and pixel-major layouts,
+// and the mode finding kernels for each supported instruction set
+
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "bucket_kernels.h"
+#include "image_processor.h"
+
+namespace
+{
+    const int kDefaultWidth = 3840;
+    const int kDefaultHeight = 2160;
+    const int kDefaultFrames = 8;
+    const int kChannels = 3;
+
+    // Frames of noise around a fixed gradient, generated once and kept in memory
+    class NoiseFrameSource : public FrameSource {
+    public:
+        NoiseFrameSource(int width, int height, int frames)
+            : data(frames)
+        {
+            std::mt19937 random(1);
+            std::uniform_int_distribution<int> noise(-6, 6);
+            std::size_t size = static_cast<std::size_t>(width) * height;
+
+            for (auto& frame : data)
+            {
+                frame.resize(size * kChannels);
+
+                for (std::size_t idx = 0; idx < frame.size(); idx++)
+                {
+                    int value = static_cast<int>((idx % width) * 255 / width) + noise(random);
+                    frame[idx] = static_cast<unsigned char>(std::min(std::max(value, 0), 255));
+                }
+            }
+        }
+
+        int frameCount() const override
+        {
+            return static_cast<int>(data.size());
+        }
+
+        const unsigned char* readFrame(int index, std::vector<unsigned char>&) override
+        {
+            return data[index].data();
+        }
+
+    private:
+        std::vector<std::vector<unsigned char>> data;
+    };
+
+    double secondsSince(std::chrono::steady_clock::time_point start)
+    {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    void runLayout(BucketLayout layout, const std::string& name, int width, int height, int frames)
+    {
+        ImageProcessor<unsigned char> processor;
+        processor.setBucketLayout(layout);
+        processor.setDecoderThreads(0, 1);
+        processor.setFrameSource(std::unique_ptr<FrameSource>(new NoiseFrameSource(width, height, frames)), width, height, kChannels);
+
+        auto start = std::chrono::steady_clock::now();
+        processor.countBuckets();
+        double countTime = secondsSince(start);
+
+        std::vector<double> modeTimes;
+        SimdLevel bestLevel = detectSimdLevel();
+
+        for (int level = 0; level <= static_cast<int>(bestLevel); level++)
+        {
+            setSimdLevel(static_cast<SimdLevel>(level));
+
+            start = std::chrono::steady_clock::now();
+            processor.findBiggestBucket();
+            modeTimes.push_back(secondsSince(start));
+        }
+
+        std::cout << std::endl << std::endl << name << std::endl;
+        std::cout << "\tCount:\t\t" << countTime << " s (" << countTime / frames * 1000.0 << " ms/frame)" << std::endl;
+
+        for (int level = 0; level <= static_cast<int>(bestLevel); level++)
+        {
+            std::cout << "\tMode " << simdLevelName(static_cast<SimdLevel>(level)) << ":\t" << modeTimes[level] << " s" << std::endl;
+        }
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    int width = argc > 1 ? std::stoi(argv[1]) : kDefaultWidth;
+    int height = argc > 2 ? std::stoi(argv[2]) : kDefaultHeight;
+    int frames = argc > 3 ? std::stoi(argv[3]) : kDefaultFrames;
+
+    std::cout << "Bucket layout benchmark, " << width << "x" << height << ", " << frames << " frames" << std::endl;
+
+    runLayout(BucketLayout::BucketMajor, "Bucket-major", width, height, frames);
+    runLayout(BucketLayout::PixelMajor, "Pixel-major", width, height, frames);
+
+    return EXIT_SUCCESS;
+}
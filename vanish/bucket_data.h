@@ -3,6 +3,9 @@
 
 #pragma once
 
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
 #include <vector>
 
 template <typename T>
@@ -12,19 +15,131 @@ struct BucketEntry {
     int diff = 0;
 };
 
-template <class T>
+// Value range of the biggest bucket of every pixel, stored planar by channel like the final buckets.
+// A value falls into the biggest bucket when low <= value <= high, so the passes test it with two compares.
+template <typename P>
+struct ModeTable {
+    std::vector<P> low;
+    std::vector<P> high;
+
+    // Channel with the biggest count of every pixel, the first one on ties
+    std::vector<unsigned char> keyChannel;
+};
+
+// Memory order of the bucket counters
+// BucketMajor stores one plane per channel, histogram and bucket, like a stack of images.
+// PixelMajor stores the A and B histograms of all channels of a pixel next to each other.
+enum class BucketLayout {
+    BucketMajor,
+    PixelMajor
+};
+
+// T is the type of the bucket counters, Id the type used to store a bucket number
+template <class T, class Id = unsigned char>
 class BucketData {
 public:
-    BucketData(int width, int height, int buckets)
-        : bucketA(width * height * buckets)
-        , bucketB(width * height * buckets)
-        , finalBucket(width * height)
+    // A bucket sum holds at most the largest value times the largest count. Up to 65535 values
+    // of 16 bits fit in 32 bits, the sums of 32-bit counters take 64 bits.
+    using SumType = typename std::conditional<sizeof(T) < sizeof(std::uint32_t), std::uint32_t, std::uint64_t>::type;
+
+    BucketData() {}
+
+    BucketData(int width, int height, int channels, int buckets, BucketLayout layout)
     {
+        reset(width, height, channels, buckets, layout);
     }
 
     ~BucketData() {}
 
-    std::vector<T> bucketA;
-    std::vector<T> bucketB;
-    std::vector<BucketEntry<T>> finalBucket;
+    // Clear the counters for the given dimensions. The allocated memory is reused when it is
+    // large enough, otherwise it is freed before the new counters are allocated.
+    void reset(int width, int height, int channels, int buckets, BucketLayout newLayout)
+    {
+        std::size_t size = static_cast<std::size_t>(width) * height;
+        std::size_t countSize = size * channels * buckets * 2;
+
+        if (countSize > counts.capacity())
+        {
+            std::vector<T>().swap(counts);
+        }
+
+        if (size * channels > finalBucket.capacity())
+        {
+            std::vector<BucketEntry<Id>>().swap(finalBucket);
+            std::vector<Id>().swap(modes.low);
+            std::vector<Id>().swap(modes.high);
+            std::vector<unsigned char>().swap(modes.keyChannel);
+        }
+
+        counts.assign(countSize, 0);
+        finalBucket.assign(size * channels, BucketEntry<Id>());
+        modes.low.resize(size * channels);
+        modes.high.resize(size * channels);
+        modes.keyChannel.resize(size);
+        sums.clear();
+
+        layout = newLayout;
+
+        if (layout == BucketLayout::PixelMajor)
+        {
+            bucketStride = 1;
+            histogramStride = buckets;
+            channelStride = 2 * buckets;
+            pixelStride = 2 * buckets * channels;
+        }
+        else
+        {
+            pixelStride = 1;
+            bucketStride = size;
+            histogramStride = buckets * size;
+            channelStride = 2 * buckets * size;
+        }
+    }
+
+    // Offset of the first A bucket of a pixel in a channel, the following buckets are bucketStride apart
+    std::size_t indexA(std::size_t idx, int channel) const
+    {
+        return idx * pixelStride + channel * channelStride;
+    }
+
+    // Offset of the first B bucket of a pixel in a channel
+    std::size_t indexB(std::size_t idx, int channel) const
+    {
+        return indexA(idx, channel) + histogramStride;
+    }
+
+    T countA(std::size_t idx, int channel, int bucket) const
+    {
+        return counts[indexA(idx, channel) + bucket * bucketStride];
+    }
+
+    T countB(std::size_t idx, int channel, int bucket) const
+    {
+        return counts[indexB(idx, channel) + bucket * bucketStride];
+    }
+
+    // Offset of a bucket given by a final bucket entry
+    std::size_t indexOf(std::size_t idx, int channel, const BucketEntry<Id>& entry) const
+    {
+        return (entry.isABucket ? indexA(idx, channel) : indexB(idx, channel)) + entry.id * bucketStride;
+    }
+
+    // Counters of both histograms for every pixel, channel and bucket
+    std::vector<T> counts;
+
+    // Sum of the values counted into every bucket, only kept when frames are added incrementally
+    // or when the bucket sums replace the first pass
+    std::vector<SumType> sums;
+
+    // Biggest bucket for every pixel, stored planar by channel
+    std::vector<BucketEntry<Id>> finalBucket;
+
+    // Value ranges of the biggest buckets, filled in for the passes over the frames
+    ModeTable<Id> modes;
+
+    BucketLayout layout = BucketLayout::BucketMajor;
+    std::size_t bucketStride = 0;
+    std::size_t histogramStride = 0;
+    std::size_t channelStride = 0;
+    std::size_t pixelStride = 0;
 };
@@ -0,0 +1,793 @@
+// BucketKernels
+// Vectorised kernels over the bucket counters, with runtime selection of the instruction set
+#include "bucket_kernels.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define VANISH_X86_SIMD 1
+#define VANISH_TARGET(isa) __attribute__((target(isa)))
+#include <immintrin.h>
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#define VANISH_X86_SIMD 1
+#define VANISH_TARGET(isa)
+#include <immintrin.h>
+#include <intrin.h>
+#endif
+
+namespace
+{
+    const int kClassifyChunk = 64;
+
+    SimdLevel selectedLevel = detectSimdLevel();
+
+    template <typename P>
+    void classifyScalar(const BucketClassifier<P>& classifier, const P* pixels, int count,
+        P* idsA, P* idsB)
+    {
+        for (int k = 0; k < count; k++)
+        {
+            idsA[k] = classifier.bucketA[pixels[k]];
+            idsB[k] = classifier.bucketB[pixels[k]];
+        }
+    }
+
+    template <typename P>
+    void countModeHitsScalar(const P* pixels, const P* low, const P* high, int count, unsigned char* hits)
+    {
+        for (int k = 0; k < count; k++)
+        {
+            hits[k] += (pixels[k] >= low[k]) & (pixels[k] <= high[k]);
+        }
+    }
+
+    // Reference implementation, works with any bucket layout
+    template <typename T, typename P>
+    void findBiggestScalar(const BucketData<T, P>& data, int channel, int buckets,
+        std::size_t begin, std::size_t end, BucketEntry<P>* entries)
+    {
+        std::size_t stride = data.bucketStride;
+
+        for (std::size_t idx = begin; idx < end; idx++)
+        {
+            const T* bucketA = data.counts.data() + data.indexA(idx, channel);
+            const T* bucketB = data.counts.data() + data.indexB(idx, channel);
+
+            T maxCount = 0;
+            int maxBucket = 0;
+            bool maxTypeA = true;
+
+            for (int bucket = 0; bucket < buckets; bucket++)
+            {
+                if (bucketA[bucket * stride] > maxCount)
+                {
+                    maxCount = bucketA[bucket * stride];
+                    maxBucket = bucket;
+                    maxTypeA = true;
+                }
+                if (bucketB[bucket * stride] > maxCount)
+                {
+                    maxCount = bucketB[bucket * stride];
+                    maxBucket = bucket;
+                    maxTypeA = false;
+                }
+            }
+
+            BucketEntry<P>& entry = entries[idx - begin];
+            entry.id = static_cast<P>(maxBucket);
+            entry.isABucket = maxTypeA;
+            entry.diff = static_cast<int>(maxCount);
+        }
+    }
+
+#ifdef VANISH_X86_SIMD
+    int countTrailingZeros(unsigned int mask)
+    {
+#ifdef _MSC_VER
+        unsigned long index = 0;
+        _BitScanForward(&index, mask);
+        return static_cast<int>(index);
+#else
+        return __builtin_ctz(mask);
+#endif
+    }
+
+    // Locate the first bucket holding maxCount, in the order A0, B0, A1, B1, ...
+    // Called with the vector part already searched up to firstBucket.
+    template <typename T, typename P>
+    void findFirstScalar(const T* bucketA, const T* bucketB, int firstBucket, int buckets,
+        T maxCount, BucketEntry<P>& entry)
+    {
+        for (int bucket = firstBucket; bucket < buckets; bucket++)
+        {
+            if (bucketA[bucket] == maxCount || bucketB[bucket] == maxCount)
+            {
+                entry.id = static_cast<P>(bucket);
+                entry.isABucket = bucketA[bucket] == maxCount;
+                return;
+            }
+        }
+    }
+
+    // Power of two bucket sizes: the A bucket is value >> shift, the B bucket is
+    // (value + half bucket) >> shift where the saturating add clamps to the last bucket
+    VANISH_TARGET("sse4.1")
+    void classifyShiftSse41(const BucketClassifier<std::uint8_t>& classifier, const std::uint8_t* pixels, int count,
+        std::uint8_t* idsA, std::uint8_t* idsB)
+    {
+        const __m128i mask = _mm_set1_epi8(static_cast<char>(0xff >> classifier.shift));
+        const __m128i half = _mm_set1_epi8(static_cast<char>(classifier.halfBucket));
+        const __m128i shift = _mm_cvtsi32_si128(classifier.shift);
+
+        int k = 0;
+
+        for (; k + 16 <= count; k += 16)
+        {
+            __m128i value = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pixels + k));
+            __m128i bucketA = _mm_and_si128(_mm_srl_epi16(value, shift), mask);
+            __m128i bucketB = _mm_and_si128(_mm_srl_epi16(_mm_adds_epu8(value, half), shift), mask);
+
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(idsA + k), bucketA);
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(idsB + k), bucketB);
+        }
+
+        classifyScalar(classifier, pixels + k, count - k, idsA + k, idsB + k);
+    }
+
+    VANISH_TARGET("avx2")
+    void classifyShiftAvx2(const BucketClassifier<std::uint8_t>& classifier, const std::uint8_t* pixels, int count,
+        std::uint8_t* idsA, std::uint8_t* idsB)
+    {
+        const __m256i mask = _mm256_set1_epi8(static_cast<char>(0xff >> classifier.shift));
+        const __m256i half = _mm256_set1_epi8(static_cast<char>(classifier.halfBucket));
+        const __m128i shift = _mm_cvtsi32_si128(classifier.shift);
+
+        int k = 0;
+
+        for (; k + 32 <= count; k += 32)
+        {
+            __m256i value = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(pixels + k));
+            __m256i bucketA = _mm256_and_si256(_mm256_srl_epi16(value, shift), mask);
+            __m256i bucketB = _mm256_and_si256(_mm256_srl_epi16(_mm256_adds_epu8(value, half), shift), mask);
+
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(idsA + k), bucketA);
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(idsB + k), bucketB);
+        }
+
+        classifyScalar(classifier, pixels + k, count - k, idsA + k, idsB + k);
+    }
+
+    // 16-bit pixels are shifted in whole lanes, so no mask is needed
+    VANISH_TARGET("sse4.1")
+    void classifyShiftSse41(const BucketClassifier<std::uint16_t>& classifier, const std::uint16_t* pixels, int count,
+        std::uint16_t* idsA, std::uint16_t* idsB)
+    {
+        const __m128i half = _mm_set1_epi16(static_cast<short>(classifier.halfBucket));
+        const __m128i shift = _mm_cvtsi32_si128(classifier.shift);
+
+        int k = 0;
+
+        for (; k + 8 <= count; k += 8)
+        {
+            __m128i value = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pixels + k));
+
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(idsA + k), _mm_srl_epi16(value, shift));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(idsB + k), _mm_srl_epi16(_mm_adds_epu16(value, half), shift));
+        }
+
+        classifyScalar(classifier, pixels + k, count - k, idsA + k, idsB + k);
+    }
+
+    VANISH_TARGET("avx2")
+    void classifyShiftAvx2(const BucketClassifier<std::uint16_t>& classifier, const std::uint16_t* pixels, int count,
+        std::uint16_t* idsA, std::uint16_t* idsB)
+    {
+        const __m256i half = _mm256_set1_epi16(static_cast<short>(classifier.halfBucket));
+        const __m128i shift = _mm_cvtsi32_si128(classifier.shift);
+
+        int k = 0;
+
+        for (; k + 16 <= count; k += 16)
+        {
+            __m256i value = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(pixels + k));
+
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(idsA + k), _mm256_srl_epi16(value, shift));
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(idsB + k), _mm256_srl_epi16(_mm256_adds_epu16(value, half), shift));
+        }
+
+        classifyScalar(classifier, pixels + k, count - k, idsA + k, idsB + k);
+    }
+
+    // Unsigned max, equality and broadcast on vector lanes of the counter type
+    template <typename T>
+    struct Sse41Ops;
+
+    template <>
+    struct Sse41Ops<std::uint8_t> {
+        VANISH_TARGET("sse4.1") static __m128i max(__m128i a, __m128i b) { return _mm_max_epu8(a, b); }
+        VANISH_TARGET("sse4.1") static __m128i min(__m128i a, __m128i b) { return _mm_min_epu8(a, b); }
+        VANISH_TARGET("sse4.1") static __m128i equal(__m128i a, __m128i b) { return _mm_cmpeq_epi8(a, b); }
+        VANISH_TARGET("sse4.1") static __m128i set(int value) { return _mm_set1_epi8(static_cast<char>(value)); }
+    };
+
+    template <>
+    struct Sse41Ops<std::uint16_t> {
+        VANISH_TARGET("sse4.1") static __m128i max(__m128i a, __m128i b) { return _mm_max_epu16(a, b); }
+        VANISH_TARGET("sse4.1") static __m128i min(__m128i a, __m128i b) { return _mm_min_epu16(a, b); }
+        VANISH_TARGET("sse4.1") static __m128i equal(__m128i a, __m128i b) { return _mm_cmpeq_epi16(a, b); }
+        VANISH_TARGET("sse4.1") static __m128i set(int value) { return _mm_set1_epi16(static_cast<short>(value)); }
+    };
+
+    template <>
+    struct Sse41Ops<std::uint32_t> {
+        VANISH_TARGET("sse4.1") static __m128i max(__m128i a, __m128i b) { return _mm_max_epu32(a, b); }
+        VANISH_TARGET("sse4.1") static __m128i min(__m128i a, __m128i b) { return _mm_min_epu32(a, b); }
+        VANISH_TARGET("sse4.1") static __m128i equal(__m128i a, __m128i b) { return _mm_cmpeq_epi32(a, b); }
+        VANISH_TARGET("sse4.1") static __m128i set(int value) { return _mm_set1_epi32(value); }
+    };
+
+    template <typename T>
+    struct Avx2Ops;
+
+    template <>
+    struct Avx2Ops<std::uint8_t> {
+        VANISH_TARGET("avx2") static __m256i max(__m256i a, __m256i b) { return _mm256_max_epu8(a, b); }
+        VANISH_TARGET("avx2") static __m256i min(__m256i a, __m256i b) { return _mm256_min_epu8(a, b); }
+        VANISH_TARGET("avx2") static __m256i equal(__m256i a, __m256i b) { return _mm256_cmpeq_epi8(a, b); }
+        VANISH_TARGET("avx2") static __m256i set(int value) { return _mm256_set1_epi8(static_cast<char>(value)); }
+    };
+
+    template <>
+    struct Avx2Ops<std::uint16_t> {
+        VANISH_TARGET("avx2") static __m256i max(__m256i a, __m256i b) { return _mm256_max_epu16(a, b); }
+        VANISH_TARGET("avx2") static __m256i min(__m256i a, __m256i b) { return _mm256_min_epu16(a, b); }
+        VANISH_TARGET("avx2") static __m256i equal(__m256i a, __m256i b) { return _mm256_cmpeq_epi16(a, b); }
+        VANISH_TARGET("avx2") static __m256i set(int value) { return _mm256_set1_epi16(static_cast<short>(value)); }
+    };
+
+    template <>
+    struct Avx2Ops<std::uint32_t> {
+        VANISH_TARGET("avx2") static __m256i max(__m256i a, __m256i b) { return _mm256_max_epu32(a, b); }
+        VANISH_TARGET("avx2") static __m256i min(__m256i a, __m256i b) { return _mm256_min_epu32(a, b); }
+        VANISH_TARGET("avx2") static __m256i equal(__m256i a, __m256i b) { return _mm256_cmpeq_epi32(a, b); }
+        VANISH_TARGET("avx2") static __m256i set(int value) { return _mm256_set1_epi32(value); }
+    };
+
+    template <typename T>
+    VANISH_TARGET("sse4.1")
+    int horizontalMax(__m128i value)
+    {
+        value = Sse41Ops<T>::max(value, _mm_srli_si128(value, 8));
+        value = Sse41Ops<T>::max(value, _mm_srli_si128(value, 4));
+
+        if (sizeof(T) <= 2)
+        {
+            value = Sse41Ops<T>::max(value, _mm_srli_si128(value, 2));
+        }
+
+        if (sizeof(T) == 1)
+        {
+            value = Sse41Ops<T>::max(value, _mm_srli_si128(value, 1));
+        }
+
+        return static_cast<int>(static_cast<T>(_mm_cvtsi128_si32(value)));
+    }
+
+    // All ones in the lanes with low <= value <= high: the value is unchanged by the max with low and the min with high
+    template <typename P>
+    VANISH_TARGET("sse4.1")
+    __m128i inRangeSse41(const P* pixels, const P* low, const P* high)
+    {
+        __m128i value = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pixels));
+        __m128i aboveLow = Sse41Ops<P>::equal(Sse41Ops<P>::max(value, _mm_loadu_si128(reinterpret_cast<const __m128i*>(low))), value);
+        __m128i belowHigh = Sse41Ops<P>::equal(Sse41Ops<P>::min(value, _mm_loadu_si128(reinterpret_cast<const __m128i*>(high))), value);
+
+        return _mm_and_si128(aboveLow, belowHigh);
+    }
+
+    template <typename P>
+    VANISH_TARGET("avx2")
+    __m256i inRangeAvx2(const P* pixels, const P* low, const P* high)
+    {
+        __m256i value = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(pixels));
+        __m256i aboveLow = Avx2Ops<P>::equal(Avx2Ops<P>::max(value, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(low))), value);
+        __m256i belowHigh = Avx2Ops<P>::equal(Avx2Ops<P>::min(value, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(high))), value);
+
+        return _mm256_and_si256(aboveLow, belowHigh);
+    }
+
+    // Byte masks of 16 or 32 pixels, 16-bit masks are packed to bytes with signed saturation
+    VANISH_TARGET("sse4.1")
+    __m128i hitMaskSse41(const std::uint8_t* pixels, const std::uint8_t* low, const std::uint8_t* high)
+    {
+        return inRangeSse41(pixels, low, high);
+    }
+
+    VANISH_TARGET("sse4.1")
+    __m128i hitMaskSse41(const std::uint16_t* pixels, const std::uint16_t* low, const std::uint16_t* high)
+    {
+        return _mm_packs_epi16(inRangeSse41(pixels, low, high), inRangeSse41(pixels + 8, low + 8, high + 8));
+    }
+
+    VANISH_TARGET("avx2")
+    __m256i hitMaskAvx2(const std::uint8_t* pixels, const std::uint8_t* low, const std::uint8_t* high)
+    {
+        return inRangeAvx2(pixels, low, high);
+    }
+
+    // The pack works within 128-bit lanes, the permute puts the pixels back in order
+    VANISH_TARGET("avx2")
+    __m256i hitMaskAvx2(const std::uint16_t* pixels, const std::uint16_t* low, const std::uint16_t* high)
+    {
+        __m256i packed = _mm256_packs_epi16(inRangeAvx2(pixels, low, high), inRangeAvx2(pixels + 16, low + 16, high + 16));
+        return _mm256_permute4x64_epi64(packed, _MM_SHUFFLE(3, 1, 2, 0));
+    }
+
+    // Subtracting the all-ones mask of a hit adds one to its counter
+    template <typename P>
+    VANISH_TARGET("sse4.1")
+    void countModeHitsSse41(const P* pixels, const P* low, const P* high, int count, unsigned char* hits)
+    {
+        int k = 0;
+
+        for (; k + 16 <= count; k += 16)
+        {
+            __m128i sum = _mm_loadu_si128(reinterpret_cast<const __m128i*>(hits + k));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(hits + k), _mm_sub_epi8(sum, hitMaskSse41(pixels + k, low + k, high + k)));
+        }
+
+        countModeHitsScalar(pixels + k, low + k, high + k, count - k, hits + k);
+    }
+
+    template <typename P>
+    VANISH_TARGET("avx2")
+    void countModeHitsAvx2(const P* pixels, const P* low, const P* high, int count, unsigned char* hits)
+    {
+        int k = 0;
+
+        for (; k + 32 <= count; k += 32)
+        {
+            __m256i sum = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(hits + k));
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(hits + k), _mm256_sub_epi8(sum, hitMaskAvx2(pixels + k, low + k, high + k)));
+        }
+
+        countModeHitsScalar(pixels + k, low + k, high + k, count - k, hits + k);
+    }
+
+    // Pixel-major: the histograms of a pixel are contiguous, so one pixel is searched a full vector of buckets at a time.
+    // A lane index is recovered from the byte mask of the comparison by dividing by the lane size.
+    template <typename T, typename P>
+    VANISH_TARGET("sse4.1")
+    void findBiggestPixelMajorSse41(const BucketData<T, P>& data, int channel, int buckets,
+        std::size_t begin, std::size_t end, BucketEntry<P>* entries)
+    {
+        const int lanes = 16 / sizeof(T);
+
+        for (std::size_t idx = begin; idx < end; idx++)
+        {
+            const T* bucketA = data.counts.data() + data.indexA(idx, channel);
+            const T* bucketB = data.counts.data() + data.indexB(idx, channel);
+
+            __m128i maxVector = _mm_setzero_si128();
+            int bucket = 0;
+
+            for (; bucket + lanes <= buckets; bucket += lanes)
+            {
+                maxVector = Sse41Ops<T>::max(maxVector, _mm_loadu_si128(reinterpret_cast<const __m128i*>(bucketA + bucket)));
+                maxVector = Sse41Ops<T>::max(maxVector, _mm_loadu_si128(reinterpret_cast<const __m128i*>(bucketB + bucket)));
+            }
+
+            int maxCount = horizontalMax<T>(maxVector);
+
+            for (; bucket < buckets; bucket++)
+            {
+                maxCount = std::max(maxCount, static_cast<int>(std::max(bucketA[bucket], bucketB[bucket])));
+            }
+
+            BucketEntry<P>& entry = entries[idx - begin];
+            entry.diff = maxCount;
+
+            __m128i target = Sse41Ops<T>::set(maxCount);
+
+            for (bucket = 0; bucket + lanes <= buckets; bucket += lanes)
+            {
+                unsigned int maskA = _mm_movemask_epi8(Sse41Ops<T>::equal(_mm_loadu_si128(reinterpret_cast<const __m128i*>(bucketA + bucket)), target));
+                unsigned int maskB = _mm_movemask_epi8(Sse41Ops<T>::equal(_mm_loadu_si128(reinterpret_cast<const __m128i*>(bucketB + bucket)), target));
+
+                if (maskA | maskB)
+                {
+                    int offset = countTrailingZeros(maskA | maskB) / static_cast<int>(sizeof(T));
+                    entry.id = static_cast<P>(bucket + offset);
+                    entry.isABucket = ((maskA >> (offset * sizeof(T))) & 1) != 0;
+                    break;
+                }
+            }
+
+            if (bucket + lanes > buckets)
+            {
+                findFirstScalar(bucketA, bucketB, bucket, buckets, static_cast<T>(maxCount), entry);
+            }
+        }
+    }
+
+    template <typename T, typename P>
+    VANISH_TARGET("avx2")
+    void findBiggestPixelMajorAvx2(const BucketData<T, P>& data, int channel, int buckets,
+        std::size_t begin, std::size_t end, BucketEntry<P>* entries)
+    {
+        const int lanes = 32 / sizeof(T);
+
+        for (std::size_t idx = begin; idx < end; idx++)
+        {
+            const T* bucketA = data.counts.data() + data.indexA(idx, channel);
+            const T* bucketB = data.counts.data() + data.indexB(idx, channel);
+
+            __m256i maxVector = _mm256_setzero_si256();
+            int bucket = 0;
+
+            for (; bucket + lanes <= buckets; bucket += lanes)
+            {
+                maxVector = Avx2Ops<T>::max(maxVector, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(bucketA + bucket)));
+                maxVector = Avx2Ops<T>::max(maxVector, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(bucketB + bucket)));
+            }
+
+            int maxCount = horizontalMax<T>(Sse41Ops<T>::max(_mm256_castsi256_si128(maxVector), _mm256_extracti128_si256(maxVector, 1)));
+
+            for (; bucket < buckets; bucket++)
+            {
+                maxCount = std::max(maxCount, static_cast<int>(std::max(bucketA[bucket], bucketB[bucket])));
+            }
+
+            BucketEntry<P>& entry = entries[idx - begin];
+            entry.diff = maxCount;
+
+            __m256i target = Avx2Ops<T>::set(maxCount);
+
+            for (bucket = 0; bucket + lanes <= buckets; bucket += lanes)
+            {
+                unsigned int maskA = _mm256_movemask_epi8(Avx2Ops<T>::equal(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(bucketA + bucket)), target));
+                unsigned int maskB = _mm256_movemask_epi8(Avx2Ops<T>::equal(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(bucketB + bucket)), target));
+
+                if (maskA | maskB)
+                {
+                    int offset = countTrailingZeros(maskA | maskB) / static_cast<int>(sizeof(T));
+                    entry.id = static_cast<P>(bucket + offset);
+                    entry.isABucket = ((maskA >> (offset * sizeof(T))) & 1) != 0;
+                    break;
+                }
+            }
+
+            if (bucket + lanes > buckets)
+            {
+                findFirstScalar(bucketA, bucketB, bucket, buckets, static_cast<T>(maxCount), entry);
+            }
+        }
+    }
+
+    // Bucket-major: every bucket is a plane, so neighbouring pixels are searched side by side
+    // and the running maximum, bucket and histogram type are kept per lane
+    template <typename T, typename P>
+    VANISH_TARGET("sse4.1")
+    void findBiggestBucketMajorSse41(const BucketData<T, P>& data, int channel, int buckets,
+        std::size_t begin, std::size_t end, BucketEntry<P>* entries)
+    {
+        const int lanes = 16 / sizeof(T);
+        const T* planeA = data.counts.data() + data.indexA(0, channel);
+        const T* planeB = data.counts.data() + data.indexB(0, channel);
+        std::size_t stride = data.bucketStride;
+        const __m128i ones = _mm_set1_epi8(-1);
+
+        std::size_t idx = begin;
+
+        for (; idx + lanes <= end; idx += lanes)
+        {
+            __m128i maxVector = _mm_setzero_si128();
+            __m128i bucketVector = _mm_setzero_si128();
+            __m128i typeAVector = ones;
+
+            for (int bucket = 0; bucket < buckets; bucket++)
+            {
+                __m128i id = Sse41Ops<T>::set(bucket);
+
+                __m128i countA = _mm_loadu_si128(reinterpret_cast<const __m128i*>(planeA + bucket * stride + idx));
+                __m128i greaterA = _mm_xor_si128(Sse41Ops<T>::equal(Sse41Ops<T>::max(countA, maxVector), maxVector), ones);
+                maxVector = Sse41Ops<T>::max(maxVector, countA);
+                bucketVector = _mm_blendv_epi8(bucketVector, id, greaterA);
+                typeAVector = _mm_or_si128(typeAVector, greaterA);
+
+                __m128i countB = _mm_loadu_si128(reinterpret_cast<const __m128i*>(planeB + bucket * stride + idx));
+                __m128i greaterB = _mm_xor_si128(Sse41Ops<T>::equal(Sse41Ops<T>::max(countB, maxVector), maxVector), ones);
+                maxVector = Sse41Ops<T>::max(maxVector, countB);
+                bucketVector = _mm_blendv_epi8(bucketVector, id, greaterB);
+                typeAVector = _mm_andnot_si128(greaterB, typeAVector);
+            }
+
+            alignas(16) T maxCounts[16 / sizeof(T)];
+            alignas(16) T maxBuckets[16 / sizeof(T)];
+            alignas(16) T maxTypes[16 / sizeof(T)];
+
+            _mm_store_si128(reinterpret_cast<__m128i*>(maxCounts), maxVector);
+            _mm_store_si128(reinterpret_cast<__m128i*>(maxBuckets), bucketVector);
+            _mm_store_si128(reinterpret_cast<__m128i*>(maxTypes), typeAVector);
+
+            for (int lane = 0; lane < lanes; lane++)
+            {
+                BucketEntry<P>& entry = entries[idx - begin + lane];
+                entry.id = static_cast<P>(maxBuckets[lane]);
+                entry.isABucket = maxTypes[lane] != 0;
+                entry.diff = static_cast<int>(maxCounts[lane]);
+            }
+        }
+
+        findBiggestScalar(data, channel, buckets, idx, end, entries + (idx - begin));
+    }
+
+    template <typename T, typename P>
+    VANISH_TARGET("avx2")
+    void findBiggestBucketMajorAvx2(const BucketData<T, P>& data, int channel, int buckets,
+        std::size_t begin, std::size_t end, BucketEntry<P>* entries)
+    {
+        const int lanes = 32 / sizeof(T);
+        const T* planeA = data.counts.data() + data.indexA(0, channel);
+        const T* planeB = data.counts.data() + data.indexB(0, channel);
+        std::size_t stride = data.bucketStride;
+        const __m256i ones = _mm256_set1_epi8(-1);
+
+        std::size_t idx = begin;
+
+        for (; idx + lanes <= end; idx += lanes)
+        {
+            __m256i maxVector = _mm256_setzero_si256();
+            __m256i bucketVector = _mm256_setzero_si256();
+            __m256i typeAVector = ones;
+
+            for (int bucket = 0; bucket < buckets; bucket++)
+            {
+                __m256i id = Avx2Ops<T>::set(bucket);
+
+                __m256i countA = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(planeA + bucket * stride + idx));
+                __m256i greaterA = _mm256_xor_si256(Avx2Ops<T>::equal(Avx2Ops<T>::max(countA, maxVector), maxVector), ones);
+                maxVector = Avx2Ops<T>::max(maxVector, countA);
+                bucketVector = _mm256_blendv_epi8(bucketVector, id, greaterA);
+                typeAVector = _mm256_or_si256(typeAVector, greaterA);
+
+                __m256i countB = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(planeB + bucket * stride + idx));
+                __m256i greaterB = _mm256_xor_si256(Avx2Ops<T>::equal(Avx2Ops<T>::max(countB, maxVector), maxVector), ones);
+                maxVector = Avx2Ops<T>::max(maxVector, countB);
+                bucketVector = _mm256_blendv_epi8(bucketVector, id, greaterB);
+                typeAVector = _mm256_andnot_si256(greaterB, typeAVector);
+            }
+
+            alignas(32) T maxCounts[32 / sizeof(T)];
+            alignas(32) T maxBuckets[32 / sizeof(T)];
+            alignas(32) T maxTypes[32 / sizeof(T)];
+
+            _mm256_store_si256(reinterpret_cast<__m256i*>(maxCounts), maxVector);
+            _mm256_store_si256(reinterpret_cast<__m256i*>(maxBuckets), bucketVector);
+            _mm256_store_si256(reinterpret_cast<__m256i*>(maxTypes), typeAVector);
+
+            for (int lane = 0; lane < lanes; lane++)
+            {
+                BucketEntry<P>& entry = entries[idx - begin + lane];
+                entry.id = static_cast<P>(maxBuckets[lane]);
+                entry.isABucket = maxTypes[lane] != 0;
+                entry.diff = static_cast<int>(maxCounts[lane]);
+            }
+        }
+
+        findBiggestScalar(data, channel, buckets, idx, end, entries + (idx - begin));
+    }
+#endif
+
+    template <typename P>
+    void classifyPixels(const BucketClassifier<P>& classifier, const P* pixels, int count,
+        P* idsA, P* idsB)
+    {
+#ifdef VANISH_X86_SIMD
+        if (classifier.shift >= 0 && selectedLevel == SimdLevel::Avx2)
+        {
+            classifyShiftAvx2(classifier, pixels, count, idsA, idsB);
+            return;
+        }
+
+        if (classifier.shift >= 0 && selectedLevel == SimdLevel::Sse41)
+        {
+            classifyShiftSse41(classifier, pixels, count, idsA, idsB);
+            return;
+        }
+#endif
+
+        classifyScalar(classifier, pixels, count, idsA, idsB);
+    }
+}
+
+SimdLevel detectSimdLevel()
+{
+#if defined(VANISH_X86_SIMD) && defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 0);
+    int maxLeaf = info[0];
+
+    __cpuid(info, 1);
+    bool sse41 = (info[2] & (1 << 19)) != 0;
+    bool osxsave = (info[2] & (1 << 27)) != 0;
+    bool avx = (info[2] & (1 << 28)) != 0;
+
+    if (maxLeaf >= 7 && osxsave && avx && (_xgetbv(0) & 6) == 6)
+    {
+        __cpuidex(info, 7, 0);
+
+        if (info[1] & (1 << 5))
+        {
+            return SimdLevel::Avx2;
+        }
+    }
+
+    return sse41 ? SimdLevel::Sse41 : SimdLevel::Scalar;
+#elif defined(VANISH_X86_SIMD)
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("avx2"))
+    {
+        return SimdLevel::Avx2;
+    }
+
+    if (__builtin_cpu_supports("sse4.1"))
+    {
+        return SimdLevel::Sse41;
+    }
+
+    return SimdLevel::Scalar;
+#else
+    return SimdLevel::Scalar;
+#endif
+}
+
+SimdLevel simdLevel()
+{
+    return selectedLevel;
+}
+
+// Select the instruction set, for comparing the kernels against each other
+void setSimdLevel(SimdLevel level)
+{
+    selectedLevel = std::min(level, detectSimdLevel());
+}
+
+std::string simdLevelName(SimdLevel level)
+{
+    switch (level)
+    {
+    case SimdLevel::Avx2:
+        return "AVX2";
+    case SimdLevel::Sse41:
+        return "SSE4.1";
+    default:
+        return "scalar";
+    }
+}
+
+// The row is classified in chunks, then the counters of each chunk are incremented.
+// Rows never share counters, so different rows may be counted in parallel.
+template <typename T, typename P>
+void countBucketRow(BucketData<T, P>& data, const BucketClassifier<P>& classifier,
+    const P* frame, std::size_t size, int channels, std::size_t rowStart, int width)
+{
+    alignas(32) P idsA[kClassifyChunk];
+    alignas(32) P idsB[kClassifyChunk];
+
+    std::size_t pixelStride = data.pixelStride;
+    std::size_t bucketStride = data.bucketStride;
+
+    for (int x = 0; x < width; x += kClassifyChunk)
+    {
+        int count = std::min(kClassifyChunk, width - x);
+
+        for (int channel = 0; channel < channels; channel++)
+        {
+            classifyPixels(classifier, frame + channel * size + rowStart + x, count, idsA, idsB);
+
+            T* countA = data.counts.data() + data.indexA(rowStart + x, channel);
+            T* countB = data.counts.data() + data.indexB(rowStart + x, channel);
+
+            for (int k = 0; k < count; k++)
+            {
+                countA[k * pixelStride + idsA[k] * bucketStride]++;
+                countB[k * pixelStride + idsB[k] * bucketStride]++;
+            }
+
+            if (data.sums.empty())
+            {
+                continue;
+            }
+
+            const P* values = frame + channel * size + rowStart + x;
+            typename BucketData<T, P>::SumType* sumA = data.sums.data() + data.indexA(rowStart + x, channel);
+            typename BucketData<T, P>::SumType* sumB = data.sums.data() + data.indexB(rowStart + x, channel);
+
+            for (int k = 0; k < count; k++)
+            {
+                sumA[k * pixelStride + idsA[k] * bucketStride] += values[k];
+                sumB[k * pixelStride + idsB[k] * bucketStride] += values[k];
+            }
+        }
+    }
+}
+
+template <typename P>
+void countModeHits(const P* pixels, const P* low, const P* high, int count, unsigned char* hits)
+{
+#ifdef VANISH_X86_SIMD
+    if (selectedLevel == SimdLevel::Avx2)
+    {
+        countModeHitsAvx2(pixels, low, high, count, hits);
+        return;
+    }
+
+    if (selectedLevel == SimdLevel::Sse41)
+    {
+        countModeHitsSse41(pixels, low, high, count, hits);
+        return;
+    }
+#endif
+
+    countModeHitsScalar(pixels, low, high, count, hits);
+}
+
+template <typename T, typename P>
+void findBiggestBuckets(const BucketData<T, P>& data, int channel, int buckets,
+    std::size_t begin, std::size_t end, BucketEntry<P>* entries)
+{
+#ifdef VANISH_X86_SIMD
+    if (data.bucketStride == 1)
+    {
+        if (selectedLevel == SimdLevel::Avx2)
+        {
+            findBiggestPixelMajorAvx2(data, channel, buckets, begin, end, entries);
+            return;
+        }
+
+        if (selectedLevel == SimdLevel::Sse41)
+        {
+            findBiggestPixelMajorSse41(data, channel, buckets, begin, end, entries);
+            return;
+        }
+    }
+    else if (data.pixelStride == 1 && static_cast<unsigned int>(buckets - 1) <= std::numeric_limits<T>::max())
+    {
+        // The bucket-major kernels keep the bucket ids in counter lanes, so they need room for every id
+        if (selectedLevel == SimdLevel::Avx2)
+        {
+            findBiggestBucketMajorAvx2(data, channel, buckets, begin, end, entries);
+            return;
+        }
+
+        if (selectedLevel == SimdLevel::Sse41)
+        {
+            findBiggestBucketMajorSse41(data, channel, buckets, begin, end, entries);
+            return;
+        }
+    }
+#endif
+
+    findBiggestScalar(data, channel, buckets, begin, end, entries);
+}
+
+template void countBucketRow(BucketData<std::uint8_t, std::uint8_t>&, const BucketClassifier<std::uint8_t>&, const std::uint8_t*, std::size_t, int, std::size_t, int);
+template void countBucketRow(BucketData<std::uint16_t, std::uint8_t>&, const BucketClassifier<std::uint8_t>&, const std::uint8_t*, std::size_t, int, std::size_t, int);
+template void countBucketRow(BucketData<std::uint32_t, std::uint8_t>&, const BucketClassifier<std::uint8_t>&, const std::uint8_t*, std::size_t, int, std::size_t, int);
+template void countBucketRow(BucketData<std::uint8_t, std::uint16_t>&, const BucketClassifier<std::uint16_t>&, const std::uint16_t*, std::size_t, int, std::size_t, int);
+template void countBucketRow(BucketData<std::uint16_t, std::uint16_t>&, const BucketClassifier<std::uint16_t>&, const std::uint16_t*, std::size_t, int, std::size_t, int);
+template void countBucketRow(BucketData<std::uint32_t, std::uint16_t>&, const BucketClassifier<std::uint16_t>&, const std::uint16_t*, std::size_t, int, std::size_t, int);
+
+template void countModeHits(const std::uint8_t*, const std::uint8_t*, const std::uint8_t*, int, unsigned char*);
+template void countModeHits(const std::uint16_t*, const std::uint16_t*, const std::uint16_t*, int, unsigned char*);
+
+template void findBiggestBuckets(const BucketData<std::uint8_t, std::uint8_t>&, int, int, std::size_t, std::size_t, BucketEntry<std::uint8_t>*);
+template void findBiggestBuckets(const BucketData<std::uint16_t, std::uint8_t>&, int, int, std::size_t, std::size_t, BucketEntry<std::uint8_t>*);
+template void findBiggestBuckets(const BucketData<std::uint32_t, std::uint8_t>&, int, int, std::size_t, std::size_t, BucketEntry<std::uint8_t>*);
+template void findBiggestBuckets(const BucketData<std::uint8_t, std::uint16_t>&, int, int, std::size_t, std::size_t, BucketEntry<std::uint16_t>*);
+template void findBiggestBuckets(const BucketData<std::uint16_t, std::uint16_t>&, int, int, std::size_t, std::size_t, BucketEntry<std::uint16_t>*);
+template void findBiggestBuckets(const BucketData<std::uint32_t, std::uint16_t>&, int, int, std::size_t, std::size_t, BucketEntry<std::uint16_t>*);
@@ -0,0 +1,64 @@
+// BucketKernels
+// Vectorised kernels over the bucket counters, with runtime selection of the instruction set
+
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#include "bucket_data.h"
+
+enum class SimdLevel {
+    Scalar,
+    Sse41,
+    Avx2
+};
+
+// Best instruction set supported by the processor
+SimdLevel detectSimdLevel();
+
+// Instruction set used by the kernels, never higher than the detected one
+SimdLevel simdLevel();
+void setSimdLevel(SimdLevel level);
+
+std::string simdLevelName(SimdLevel level);
+
+// Maps color intensity values of pixel type P to their A and B buckets
+// The tables hold the bucket of every value P can hold. When the bucket size is a power of two
+// and the buckets cover the whole range of P, the buckets can also be computed with shifts,
+// and shift holds the bucket size exponent.
+template <typename P>
+struct BucketClassifier {
+    std::vector<P> bucketA;
+    std::vector<P> bucketB;
+    int shift = -1;
+    int halfBucket = 0;
+
+    // Smallest and largest value of every A and B bucket
+    std::vector<P> lowA;
+    std::vector<P> highA;
+    std::vector<P> lowB;
+    std::vector<P> highB;
+};
+
+// The kernels are instantiated for 8 and 16-bit pixels, T is the counter type.
+// Bucket ids are stored in the pixel type, which always has room for every bucket.
+
+// Count one row of a planar frame into the buckets of every channel.
+// When the bucket data keeps sums, the values are added to the sums of their buckets as well.
+template <typename T, typename P>
+void countBucketRow(BucketData<T, P>& data, const BucketClassifier<P>& classifier,
+    const P* frame, std::size_t size, int channels, std::size_t rowStart, int width);
+
+// Add one to hits[k] for every pixel k of a run whose value lies in [low[k], high[k]].
+// Used by the passes to test whether a pixel falls into its biggest bucket.
+template <typename P>
+void countModeHits(const P* pixels, const P* low, const P* high, int count, unsigned char* hits);
+
+// Find the biggest bucket of one channel for the pixels [begin, end).
+// Buckets are compared in the order A0, B0, A1, B1, ... and the first biggest one wins.
+// The results are written to entries[0 .. end - begin).
+template <typename T, typename P>
+void findBiggestBuckets(const BucketData<T, P>& data, int channel, int buckets,
+    std::size_t begin, std::size_t end, BucketEntry<P>* entries);
@@ -0,0 +1,147 @@
+// ClusterSketch
+// Small fixed set of weighted color clusters per pixel, a low-memory alternative to the bucket histograms
+
+#pragma once
+
+#include <cstddef>
+#include <cstdlib>
+#include <vector>
+
+// Estimator of the background value of every pixel
+// Buckets counts every frame into histograms and reads the frames again for the passes.
+// Clusters keeps a few weighted colors per pixel and updates them in one pass over the frames.
+enum class Estimator {
+    Buckets,
+    Clusters
+};
+
+// T is the type of the cluster weights, which has to hold the number of frames, P the pixel type.
+// Every pixel keeps kClusters colors with the number of frames that matched them. A frame matches
+// a cluster when every channel lies within the radius of it, and then moves the color towards
+// itself by its share of the weight. A frame that matches no cluster replaces the lightest one,
+// so the transient colors compete for the other slots while the background keeps its own.
+template <class T, class P>
+class ClusterSketch {
+public:
+    static const int kClusters = 4;
+
+    // Clear the clusters for the given dimensions, reusing the memory when it is large enough
+    void reset(int width, int height, int newChannels)
+    {
+        std::size_t size = static_cast<std::size_t>(width) * height;
+
+        if (size * kClusters * newChannels > colors.capacity())
+        {
+            std::vector<P>().swap(colors);
+            std::vector<T>().swap(weights);
+        }
+
+        channels = newChannels;
+        colors.assign(size * kClusters * channels, 0);
+        weights.assign(size * kClusters, 0);
+    }
+
+    // Add one row of a planar frame to the clusters of its pixels
+    void addRow(const P* frame, std::size_t frameSize, std::size_t rowStart, int width, int radius)
+    {
+        for (std::size_t idx = rowStart; idx < rowStart + width; idx++)
+        {
+            T* pixelWeights = weights.data() + idx * kClusters;
+            P* pixelColors = colors.data() + idx * kClusters * channels;
+
+            int match = -1;
+            int lightest = 0;
+
+            for (int cluster = 0; cluster < kClusters; cluster++)
+            {
+                if (pixelWeights[cluster] < pixelWeights[lightest])
+                {
+                    lightest = cluster;
+                }
+
+                if (match >= 0 || pixelWeights[cluster] == 0)
+                {
+                    continue;
+                }
+
+                bool inside = true;
+
+                for (int channel = 0; channel < channels && inside; channel++)
+                {
+                    int value = frame[idx + channel * frameSize];
+                    inside = std::abs(value - pixelColors[cluster * channels + channel]) <= radius;
+                }
+
+                if (inside)
+                {
+                    match = cluster;
+                }
+            }
+
+            if (match < 0)
+            {
+                pixelWeights[lightest] = 1;
+
+                for (int channel = 0; channel < channels; channel++)
+                {
+                    pixelColors[lightest * channels + channel] = frame[idx + channel * frameSize];
+                }
+
+                continue;
+            }
+
+            // Running mean of the matched frames, rounded to the nearest value
+            T matched = ++pixelWeights[match];
+
+            for (int channel = 0; channel < channels; channel++)
+            {
+                P& mean = pixelColors[match * channels + channel];
+                int delta = static_cast<int>(frame[idx + channel * frameSize]) - mean;
+                int step = (2 * delta + (delta < 0 ? -1 : 1) * static_cast<int>(matched)) / (2 * static_cast<int>(matched));
+
+                mean = static_cast<P>(mean + step);
+            }
+        }
+    }
+
+    // Cluster with the most frames of a pixel, the first one on ties
+    int heaviest(std::size_t idx) const
+    {
+        const T* pixelWeights = weights.data() + idx * kClusters;
+        int best = 0;
+
+        for (int cluster = 1; cluster < kClusters; cluster++)
+        {
+            if (pixelWeights[cluster] > pixelWeights[best])
+            {
+                best = cluster;
+            }
+        }
+
+        return best;
+    }
+
+    P color(std::size_t idx, int cluster, int channel) const
+    {
+        return colors[(idx * kClusters + cluster) * channels + channel];
+    }
+
+    T weight(std::size_t idx, int cluster) const
+    {
+        return weights[idx * kClusters + cluster];
+    }
+
+    // Bytes of the clusters of one pixel
+    static std::size_t pixelBytes(int channels)
+    {
+        return kClusters * (channels * sizeof(P) + sizeof(T));
+    }
+
+    // Colors of the clusters, interleaved by channel, kClusters per pixel
+    std::vector<P> colors;
+
+    // Number of frames that matched every cluster
+    std::vector<T> weights;
+
+    int channels = 0;
+};
@@ -0,0 +1,154 @@
+// FramePipeline
+// Decodes frames of a sequence ahead of the consumer on a pool of decoder threads
+#include "frame_pipeline.h"
+
+#include <algorithm>
+#include <chrono>
+
+FramePipeline::FramePipeline(FrameSource& src, int decoderThreads, int lookahead)
+    : source(src)
+{
+    frames = source.frameCount();
+
+    lookahead = std::max(lookahead, 1);
+    decoderThreads = std::min(decoderThreads, lookahead);
+
+    slots.resize(lookahead);
+
+    for (int i = 0; i < decoderThreads; i++)
+    {
+        decoders.emplace_back(&FramePipeline::decodeFrames, this);
+    }
+}
+
+FramePipeline::~FramePipeline()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+
+    slotFree.notify_all();
+
+    for (auto& decoder : decoders)
+    {
+        decoder.join();
+    }
+}
+
+// Decoder thread: claim the next frame as soon as its slot in the ring is free
+void FramePipeline::decodeFrames()
+{
+    int slotCount = static_cast<int>(slots.size());
+
+    while (true)
+    {
+        int index = 0;
+
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+
+            // The consumer still holds frame nextConsume - 1, every later slot may be filled
+            slotFree.wait(lock, [&] { return stopping || nextDecode >= frames || nextDecode < std::max(nextConsume - 1, 0) + slotCount; });
+
+            if (stopping || nextDecode >= frames)
+            {
+                return;
+            }
+
+            index = nextDecode++;
+        }
+
+        Slot& slot = slots[index % slotCount];
+
+        auto start = std::chrono::steady_clock::now();
+        const unsigned char* data = nullptr;
+        std::exception_ptr error;
+
+        // The consumer rethrows the error when it reaches the frame
+        try
+        {
+            data = source.readFrame(index, slot.buffer);
+        }
+        catch (...)
+        {
+            error = std::current_exception();
+        }
+
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            slot.data = data;
+            slot.error = error;
+            slot.ready = true;
+            decodeTime += elapsed.count();
+        }
+
+        frameReady.notify_all();
+    }
+}
+
+const unsigned char* FramePipeline::next()
+{
+    int slotCount = static_cast<int>(slots.size());
+
+    if (nextConsume >= frames)
+    {
+        return nullptr;
+    }
+
+    int index = nextConsume;
+    Slot& slot = slots[index % slotCount];
+
+    // Without decoder threads the frame is read on the calling thread
+    if (decoders.empty())
+    {
+        nextConsume++;
+
+        auto start = std::chrono::steady_clock::now();
+        const unsigned char* data = source.readFrame(index, slot.buffer);
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+        decodeTime += elapsed.count();
+        waitTime += elapsed.count();
+
+        return data;
+    }
+
+    std::unique_lock<std::mutex> lock(mutex);
+
+    // Release the previous frame and wait for the decoders to deliver this one
+    if (index > 0)
+    {
+        slots[(index - 1) % slotCount].ready = false;
+    }
+
+    nextConsume++;
+    slotFree.notify_all();
+
+    auto start = std::chrono::steady_clock::now();
+    frameReady.wait(lock, [&] { return slot.ready; });
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    waitTime += elapsed.count();
+
+    if (slot.error)
+    {
+        std::rethrow_exception(slot.error);
+    }
+
+    return slot.data;
+}
+
+double FramePipeline::decodeSeconds() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return decodeTime;
+}
+
+double FramePipeline::waitSeconds() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return waitTime;
+}
@@ -0,0 +1,59 @@
+// FramePipeline
+// Decodes frames of a sequence ahead of the consumer on a pool of decoder threads
+
+#pragma once
+
+#include <condition_variable>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "frame_source.h"
+
+class FramePipeline {
+public:
+    FramePipeline(FrameSource& src, int decoderThreads, int lookahead);
+    ~FramePipeline();
+
+    FramePipeline(const FramePipeline&) = delete;
+    FramePipeline& operator=(const FramePipeline&) = delete;
+
+    // Return the next frame in sequence order, or nullptr after the last frame.
+    // The previously returned frame is handed back to the decoders.
+    // An error reading the frame on a decoder thread is thrown again here.
+    const unsigned char* next();
+
+    // Time spent reading frames from the source, summed over the decoder threads
+    double decodeSeconds() const;
+
+    // Time the consumer waited in next() for frames to be decoded
+    double waitSeconds() const;
+
+private:
+    struct Slot {
+        std::vector<unsigned char> buffer;
+        const unsigned char* data = nullptr;
+        std::exception_ptr error;
+        bool ready = false;
+    };
+
+    void decodeFrames();
+
+    FrameSource& source;
+    int frames = 0;
+
+    std::vector<Slot> slots;
+    std::vector<std::thread> decoders;
+
+    mutable std::mutex mutex;
+    std::condition_variable frameReady;
+    std::condition_variable slotFree;
+
+    int nextDecode = 0;
+    int nextConsume = 0;
+    bool stopping = false;
+
+    double decodeTime = 0.0;
+    double waitTime = 0.0;
+};
@@ -0,0 +1,390 @@
+// FrameSource
+// Supplies decoded frames of the image sequence to the image processor
+#include "frame_source.h"
+#include "processing_error.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <CImg.h>
+
+namespace
+{
+    // Copy the rows of a band out of a whole planar frame into the buffer.
+    // The frame may itself be stored in the buffer, the planes are then moved down in place.
+    const unsigned char* cropRows(const unsigned char* frame, const FrameRows& band, std::vector<unsigned char>& buffer)
+    {
+        std::size_t rowBytes = static_cast<std::size_t>(band.width) * band.sampleBytes;
+        std::size_t plane = rowBytes * band.height;
+        std::size_t bandPlane = rowBytes * band.rows;
+        std::size_t offset = rowBytes * band.firstRow;
+
+        if (frame == buffer.data())
+        {
+            for (int channel = 0; channel < band.channels; channel++)
+            {
+                std::memmove(buffer.data() + channel * bandPlane, buffer.data() + channel * plane + offset, bandPlane);
+            }
+
+            buffer.resize(band.channels * bandPlane);
+        }
+        else
+        {
+            buffer.resize(band.channels * bandPlane);
+
+            for (int channel = 0; channel < band.channels; channel++)
+            {
+                std::memcpy(buffer.data() + channel * bandPlane, frame + channel * plane + offset, bandPlane);
+            }
+        }
+
+        return buffer.data();
+    }
+}
+
+// Frames are processed in file name order, which matters for sliding windows
+std::vector<std::string> findFrameFiles(const std::string& directory, const std::string& extension)
+{
+    std::vector<std::string> fileNames;
+    std::filesystem::path imagePath(directory);
+
+    if (!std::filesystem::is_directory(imagePath))
+    {
+        return fileNames;
+    }
+
+    for (std::filesystem::directory_iterator itr(imagePath); itr != std::filesystem::directory_iterator(); ++itr)
+    {
+        if (std::filesystem::is_regular_file(*itr) && itr->path().extension() == std::string(".") + extension)
+        {
+            fileNames.push_back(itr->path().string());
+        }
+    }
+
+    std::sort(fileNames.begin(), fileNames.end());
+
+    return fileNames;
+}
+
+const unsigned char* FrameSource::readRows(int index, const FrameRows& band, std::vector<unsigned char>& buffer)
+{
+    return cropRows(readFrame(index, buffer), band, buffer);
+}
+
+FileFrameSource::FileFrameSource(const std::vector<std::string>& fn, int width, int height, int channels, int sampleBytes)
+    : fileNames(fn)
+    , width(width)
+    , height(height)
+    , channels(channels)
+    , sampleBytes(sampleBytes)
+{
+}
+
+FileFrameSource::~FileFrameSource()
+{
+}
+
+int FileFrameSource::frameCount() const
+{
+    return static_cast<int>(fileNames.size());
+}
+
+// Decode an image file into the buffer
+const unsigned char* FileFrameSource::readFrame(int index, std::vector<unsigned char>& buffer)
+{
+    if (sampleBytes == 2)
+    {
+        decodeFrame<std::uint16_t>(fileNames[index], buffer);
+    }
+    else
+    {
+        decodeFrame<unsigned char>(fileNames[index], buffer);
+    }
+
+    return buffer.data();
+}
+
+// Decode an image file with samples of type T and copy its bytes into the buffer
+template <typename T>
+void FileFrameSource::decodeFrame(const std::string& fn, std::vector<unsigned char>& buffer) const
+{
+    cimg_library::CImg<T> newImage(fn.c_str());
+
+    if (newImage.width() != width || newImage.height() != height || newImage.spectrum() != channels)
+    {
+        throw ProcessingError("Frame " + fn + " does not match the sequence dimensions.");
+    }
+
+    const unsigned char* data = reinterpret_cast<const unsigned char*>(newImage.data());
+    buffer.assign(data, data + newImage.size() * sizeof(T));
+}
+
+FrameCache::FrameCache(std::unique_ptr<FrameSource> src, std::size_t bytesPerFrame, std::size_t memoryBudget)
+    : source(std::move(src))
+    , frameBytes(bytesPerFrame)
+{
+    frames = source->frameCount();
+
+    std::size_t budgetFrames = frameBytes > 0 ? memoryBudget / frameBytes : 0;
+    memoryFrames = static_cast<int>(std::min(budgetFrames, static_cast<std::size_t>(frames)));
+
+    memory.resize(memoryFrames);
+    cached.resize(frames);
+}
+
+FrameCache::~FrameCache()
+{
+    if (scratch)
+    {
+        std::fclose(scratch);
+    }
+}
+
+int FrameCache::frameCount() const
+{
+    return frames;
+}
+
+// Number of frames that fit in the memory budget
+int FrameCache::memoryFrameCount() const
+{
+    return memoryFrames;
+}
+
+// Return the cached frame, decoding it from the underlying source on first access
+const unsigned char* FrameCache::readFrame(int index, std::vector<unsigned char>& buffer)
+{
+    if (index < memoryFrames)
+    {
+        if (!cached[index])
+        {
+            const unsigned char* data = source->readFrame(index, memory[index]);
+
+            if (data != memory[index].data())
+            {
+                memory[index].assign(data, data + frameBytes);
+            }
+
+            cached[index] = true;
+        }
+
+        return memory[index].data();
+    }
+
+    if (!cached[index])
+    {
+        const unsigned char* data = source->readFrame(index, buffer);
+
+        std::lock_guard<std::mutex> lock(scratchMutex);
+
+        openScratch();
+        seekScratch(index, 0);
+
+        if (std::fwrite(data, 1, frameBytes, scratch) != frameBytes)
+        {
+            throw ProcessingError("Failed to write the frame cache scratch file.");
+        }
+
+        cached[index] = true;
+
+        return data;
+    }
+
+    buffer.resize(frameBytes);
+
+    std::lock_guard<std::mutex> lock(scratchMutex);
+
+    seekScratch(index, 0);
+
+    if (std::fread(buffer.data(), 1, frameBytes, scratch) != frameBytes)
+    {
+        throw ProcessingError("Failed to read the frame cache scratch file.");
+    }
+
+    return buffer.data();
+}
+
+// Return a band of a cached frame. Frames that are spilled to the scratch file
+// read only the rows of the band, one channel plane at a time.
+const unsigned char* FrameCache::readRows(int index, const FrameRows& band, std::vector<unsigned char>& buffer)
+{
+    if (index < memoryFrames || !cached[index])
+    {
+        return cropRows(readFrame(index, buffer), band, buffer);
+    }
+
+    std::size_t rowBytes = static_cast<std::size_t>(band.width) * band.sampleBytes;
+    std::size_t plane = rowBytes * band.height;
+    std::size_t bandPlane = rowBytes * band.rows;
+    std::size_t offset = rowBytes * band.firstRow;
+
+    buffer.resize(band.channels * bandPlane);
+
+    std::lock_guard<std::mutex> lock(scratchMutex);
+
+    for (int channel = 0; channel < band.channels; channel++)
+    {
+        seekScratch(index, channel * plane + offset);
+
+        if (std::fread(buffer.data() + channel * bandPlane, 1, bandPlane, scratch) != bandPlane)
+        {
+            throw ProcessingError("Failed to read the frame cache scratch file.");
+        }
+    }
+
+    return buffer.data();
+}
+
+// Frames in memory are cropped and spilled frames read row by row, so bands never cost a whole frame
+bool FrameCache::readsRows() const
+{
+    return true;
+}
+
+// Create the scratch file for frames that do not fit in memory
+void FrameCache::openScratch()
+{
+    if (scratch)
+    {
+        return;
+    }
+
+    scratch = std::tmpfile();
+
+    if (!scratch)
+    {
+        throw ProcessingError("Failed to create the frame cache scratch file.");
+    }
+}
+
+// Move to a byte offset within a spilled frame in the scratch file
+void FrameCache::seekScratch(int index, std::size_t offset)
+{
+    long long position = static_cast<long long>(index - memoryFrames) * static_cast<long long>(frameBytes) + static_cast<long long>(offset);
+
+#ifdef _WIN32
+    int result = _fseeki64(scratch, position, SEEK_SET);
+#else
+    int result = fseeko(scratch, static_cast<off_t>(position), SEEK_SET);
+#endif
+
+    if (result != 0)
+    {
+        throw ProcessingError("Failed to seek in the frame cache scratch file.");
+    }
+}
+
+FrameBand::FrameBand(FrameSource& src, const FrameRows& rows)
+    : source(src)
+    , band(rows)
+{
+}
+
+FrameBand::~FrameBand()
+{
+}
+
+int FrameBand::frameCount() const
+{
+    return source.frameCount();
+}
+
+const unsigned char* FrameBand::readFrame(int index, std::vector<unsigned char>& buffer)
+{
+    return source.readRows(index, band, buffer);
+}
+
+FrameSubset::FrameSubset(std::unique_ptr<FrameSource> src, const std::vector<int>& frames)
+    : source(std::move(src))
+    , indices(frames)
+{
+}
+
+FrameSubset::~FrameSubset()
+{
+}
+
+int FrameSubset::frameCount() const
+{
+    return static_cast<int>(indices.size());
+}
+
+const unsigned char* FrameSubset::readFrame(int index, std::vector<unsigned char>& buffer)
+{
+    return source->readFrame(indices[index], buffer);
+}
+
+const unsigned char* FrameSubset::readRows(int index, const FrameRows& band, std::vector<unsigned char>& buffer)
+{
+    return source->readRows(indices[index], band, buffer);
+}
+
+bool FrameSubset::readsRows() const
+{
+    return source->readsRows();
+}
+
+FrameRowSelection::FrameRowSelection(FrameSource& src, const FrameRows& frame, const std::vector<RowSpan>& spans)
+    : source(src)
+    , frameRows(frame)
+    , rowSpans(spans)
+{
+    for (const auto& span : rowSpans)
+    {
+        selectedRows += span.rows;
+    }
+}
+
+FrameRowSelection::~FrameRowSelection()
+{
+}
+
+int FrameRowSelection::frameCount() const
+{
+    return source.frameCount();
+}
+
+const unsigned char* FrameRowSelection::readFrame(int index, std::vector<unsigned char>& buffer)
+{
+    std::size_t rowBytes = static_cast<std::size_t>(frameRows.width) * frameRows.sampleBytes;
+    std::size_t selectedPlane = rowBytes * selectedRows;
+
+    std::vector<unsigned char> sourceBuffer;
+    const unsigned char* whole = source.readsRows() ? nullptr : source.readFrame(index, sourceBuffer);
+
+    buffer.resize(frameRows.channels * selectedPlane);
+
+    std::size_t selectedOffset = 0;
+
+    for (const auto& span : rowSpans)
+    {
+        std::size_t spanBytes = rowBytes * span.rows;
+        const unsigned char* spanData = nullptr;
+        std::size_t plane = 0;
+
+        if (whole)
+        {
+            spanData = whole + rowBytes * span.firstRow;
+            plane = rowBytes * frameRows.height;
+        }
+        else
+        {
+            FrameRows band = frameRows;
+            band.firstRow = span.firstRow;
+            band.rows = span.rows;
+
+            spanData = source.readRows(index, band, sourceBuffer);
+            plane = spanBytes;
+        }
+
+        for (int channel = 0; channel < frameRows.channels; channel++)
+        {
+            std::memcpy(buffer.data() + channel * selectedPlane + selectedOffset, spanData + channel * plane, spanBytes);
+        }
+
+        selectedOffset += spanBytes;
+    }
+
+    return buffer.data();
+}
@@ -0,0 +1,152 @@
+// FrameSource
+// Supplies decoded frames of the image sequence to the image processor
+
+#pragma once
+
+#include <cstddef>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// A band of rows [firstRow, firstRow + rows) of frames with the given dimensions
+struct FrameRows {
+    int width = 0;
+    int height = 0;
+    int channels = 0;
+    int sampleBytes = 1;
+    int firstRow = 0;
+    int rows = 0;
+};
+
+// A run of consecutive rows [firstRow, firstRow + rows)
+struct RowSpan {
+    int firstRow = 0;
+    int rows = 0;
+};
+
+// List the files with the given extension in a directory, sorted by name
+std::vector<std::string> findFrameFiles(const std::string& directory, const std::string& extension);
+
+// Interface for anything that can produce frames of the sequence
+// Frame data is planar, in the same layout as CImg: x runs fastest, then y, then channel.
+// Samples are stored in the native byte order, one byte for 8-bit and two bytes for deeper frames.
+// Sources must allow different frames to be read concurrently from several threads
+class FrameSource {
+public:
+    virtual ~FrameSource() {}
+
+    virtual int frameCount() const = 0;
+
+    // Return a pointer to the planar data of a frame. The pointer refers either to storage
+    // owned by the source or to the given buffer, and stays valid until the buffer is reused.
+    virtual const unsigned char* readFrame(int index, std::vector<unsigned char>& buffer) = 0;
+
+    // Return the planar data of a band of rows of a frame, with the same pointer rules as readFrame.
+    // The default implementation reads the whole frame and crops it.
+    virtual const unsigned char* readRows(int index, const FrameRows& band, std::vector<unsigned char>& buffer);
+
+    // True when readRows reads only the rows of the band, so a few bands cost less than the whole frame
+    virtual bool readsRows() const { return false; }
+};
+
+// Decodes frames from image files
+class FileFrameSource : public FrameSource {
+public:
+    FileFrameSource(const std::vector<std::string>& fn, int width, int height, int channels, int sampleBytes);
+    ~FileFrameSource();
+
+    int frameCount() const override;
+    const unsigned char* readFrame(int index, std::vector<unsigned char>& buffer) override;
+
+private:
+    template <typename T>
+    void decodeFrame(const std::string& fn, std::vector<unsigned char>& buffer) const;
+
+    std::vector<std::string> fileNames;
+
+    int width = 0;
+    int height = 0;
+    int channels = 0;
+    int sampleBytes = 1;
+};
+
+// Reads every frame of another source once and keeps the decoded data for later reads.
+// Frames are held in memory until the memory budget is used up, the rest are spilled
+// to a raw scratch file.
+class FrameCache : public FrameSource {
+public:
+    FrameCache(std::unique_ptr<FrameSource> src, std::size_t bytesPerFrame, std::size_t memoryBudget);
+    ~FrameCache();
+
+    int frameCount() const override;
+    const unsigned char* readFrame(int index, std::vector<unsigned char>& buffer) override;
+    const unsigned char* readRows(int index, const FrameRows& band, std::vector<unsigned char>& buffer) override;
+    bool readsRows() const override;
+
+    int memoryFrameCount() const;
+
+private:
+    void openScratch();
+    void seekScratch(int index, std::size_t offset);
+
+    std::unique_ptr<FrameSource> source;
+
+    std::size_t frameBytes = 0;
+    int frames = 0;
+    int memoryFrames = 0;
+
+    std::vector<std::vector<unsigned char>> memory;
+    std::vector<unsigned char> cached;
+    std::FILE* scratch = nullptr;
+    std::mutex scratchMutex;
+};
+
+// Presents a band of rows of another source as frames of their own
+class FrameBand : public FrameSource {
+public:
+    FrameBand(FrameSource& src, const FrameRows& rows);
+    ~FrameBand();
+
+    int frameCount() const override;
+    const unsigned char* readFrame(int index, std::vector<unsigned char>& buffer) override;
+
+private:
+    FrameSource& source;
+    FrameRows band;
+};
+
+// Presents a selection of the frames of another source, such as the frames left after dropping bad ones
+class FrameSubset : public FrameSource {
+public:
+    FrameSubset(std::unique_ptr<FrameSource> src, const std::vector<int>& frames);
+    ~FrameSubset();
+
+    int frameCount() const override;
+    const unsigned char* readFrame(int index, std::vector<unsigned char>& buffer) override;
+    const unsigned char* readRows(int index, const FrameRows& band, std::vector<unsigned char>& buffer) override;
+    bool readsRows() const override;
+
+private:
+    std::unique_ptr<FrameSource> source;
+    std::vector<int> indices;
+};
+
+// Presents some spans of rows of another source stacked into frames of their own, planar like
+// the source, such as the rows that still have pixels for the second pass. Sources that read
+// rows on their own are read span by span, the others are read whole once per frame.
+class FrameRowSelection : public FrameSource {
+public:
+    FrameRowSelection(FrameSource& src, const FrameRows& frame, const std::vector<RowSpan>& spans);
+    ~FrameRowSelection();
+
+    int frameCount() const override;
+    const unsigned char* readFrame(int index, std::vector<unsigned char>& buffer) override;
+
+private:
+    FrameSource& source;
+    FrameRows frameRows;
+    std::vector<RowSpan> rowSpans;
+    int selectedRows = 0;
+};
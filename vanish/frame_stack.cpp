@@ -0,0 +1,328 @@
+// FrameStack
+// Raw on-disk copy of a decoded image sequence, memory-mapped by later runs
+#include "frame_stack.h"
+#include "frame_pipeline.h"
+#include "processing_error.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <system_error>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace
+{
+    const char kStackMagic[8] = "VNSTACK";
+    const std::uint32_t kStackVersion = 1;
+    const std::size_t kHeaderBytes = 4096;
+    const std::uint64_t kFnvOffset = 14695981039346656037ull;
+    const std::uint64_t kFnvPrime = 1099511628211ull;
+
+    void hashBytes(std::uint64_t& hash, const void* bytes, std::size_t count)
+    {
+        const unsigned char* data = static_cast<const unsigned char*>(bytes);
+
+        for (std::size_t i = 0; i < count; i++)
+        {
+            hash = (hash ^ data[i]) * kFnvPrime;
+        }
+    }
+
+    std::size_t stackFrameBytes(const FrameStackHeader& header)
+    {
+        return static_cast<std::size_t>(header.width) * header.height * header.channels * header.sampleBytes;
+    }
+
+    void seekStack(std::FILE* file, std::size_t offset)
+    {
+#ifdef _WIN32
+        int result = _fseeki64(file, static_cast<long long>(offset), SEEK_SET);
+#else
+        int result = fseeko(file, static_cast<off_t>(offset), SEEK_SET);
+#endif
+
+        if (result != 0)
+        {
+            throw ProcessingError("Failed to seek in the frame stack file.");
+        }
+    }
+
+    void writeStack(std::FILE* file, const void* data, std::size_t bytes)
+    {
+        if (std::fwrite(data, 1, bytes, file) != bytes)
+        {
+            throw ProcessingError("Failed to write the frame stack file.");
+        }
+    }
+
+    // Write the header page and every frame of the source, in tiles of rows
+    void writeStackFrames(std::FILE* file, FrameSource& source, const FrameStackHeader& header, int decoderThreads, int lookahead)
+    {
+        std::vector<unsigned char> headerPage(kHeaderBytes, 0);
+        std::memcpy(headerPage.data(), &header, sizeof(header));
+        writeStack(file, headerPage.data(), headerPage.size());
+
+        std::size_t rowBytes = static_cast<std::size_t>(header.width) * header.sampleBytes;
+        std::size_t plane = rowBytes * header.height;
+        int tiles = (header.height + header.tileRows - 1) / header.tileRows;
+
+        FramePipeline pipeline(source, decoderThreads, lookahead);
+
+        for (std::uint32_t frame = 0; frame < header.frames; frame++)
+        {
+            const unsigned char* data = pipeline.next();
+
+            for (int tile = 0; tile < tiles; tile++)
+            {
+                std::size_t firstRow = static_cast<std::size_t>(tile) * header.tileRows;
+                std::size_t rows = std::min<std::size_t>(header.tileRows, header.height - firstRow);
+                std::size_t tileFrameBytes = rows * rowBytes * header.channels;
+
+                seekStack(file, kHeaderBytes + firstRow * rowBytes * header.channels * header.frames + frame * tileFrameBytes);
+
+                for (std::uint32_t channel = 0; channel < header.channels; channel++)
+                {
+                    writeStack(file, data + channel * plane + firstRow * rowBytes, rows * rowBytes);
+                }
+            }
+        }
+    }
+}
+
+FrameStackHeader frameStackHeader(const std::vector<std::string>& fileNames, int width, int height, int channels, int sampleBytes, int tileRows)
+{
+    FrameStackHeader header;
+
+    std::memcpy(header.magic, kStackMagic, sizeof(header.magic));
+    header.version = kStackVersion;
+    header.width = width;
+    header.height = height;
+    header.channels = channels;
+    header.sampleBytes = sampleBytes;
+    header.frames = static_cast<std::uint32_t>(fileNames.size());
+    header.tileRows = std::min(std::max(tileRows, 1), height);
+
+    // A changed, added or removed input file makes the stack stale
+    header.fingerprint = kFnvOffset;
+
+    for (const auto& fn : fileNames)
+    {
+        std::error_code error;
+        std::uintmax_t fileSize = std::filesystem::file_size(fn, error);
+        long long modified = std::filesystem::last_write_time(fn, error).time_since_epoch().count();
+
+        hashBytes(header.fingerprint, fn.data(), fn.size() + 1);
+        hashBytes(header.fingerprint, &fileSize, sizeof(fileSize));
+        hashBytes(header.fingerprint, &modified, sizeof(modified));
+    }
+
+    return header;
+}
+
+// The stack is written to a temporary file and renamed once complete,
+// so an interrupted run never leaves a stack that looks valid
+void writeFrameStack(const std::string& fn, FrameSource& source, const FrameStackHeader& header, int decoderThreads, int lookahead)
+{
+    std::string partial = fn + ".part";
+    std::FILE* file = std::fopen(partial.c_str(), "wb");
+
+    if (!file)
+    {
+        throw ProcessingError("Could not create frame stack file " + fn + "!");
+    }
+
+    // A frame that cannot be read leaves no partial stack behind
+    try
+    {
+        writeStackFrames(file, source, header, decoderThreads, lookahead);
+    }
+    catch (...)
+    {
+        std::fclose(file);
+        std::remove(partial.c_str());
+        throw;
+    }
+
+    if (std::fclose(file) != 0)
+    {
+        throw ProcessingError("Failed to write the frame stack file.");
+    }
+
+    std::error_code error;
+    std::filesystem::rename(partial, fn, error);
+
+    if (error)
+    {
+        throw ProcessingError("Could not create frame stack file " + fn + "!");
+    }
+}
+
+MappedFrameStack::MappedFrameStack(const unsigned char* mappedData, std::size_t bytes)
+    : data(mappedData)
+    , mappedBytes(bytes)
+{
+    std::memcpy(&header, data, sizeof(header));
+}
+
+MappedFrameStack::~MappedFrameStack()
+{
+#ifdef _WIN32
+    UnmapViewOfFile(data);
+#else
+    munmap(const_cast<unsigned char*>(data), mappedBytes);
+#endif
+}
+
+std::unique_ptr<MappedFrameStack> MappedFrameStack::open(const std::string& fn, const FrameStackHeader& expected)
+{
+    std::error_code error;
+    std::uintmax_t fileSize = std::filesystem::file_size(fn, error);
+
+    if (error || fileSize != kHeaderBytes + stackFrameBytes(expected) * expected.frames)
+    {
+        return nullptr;
+    }
+
+    std::size_t bytes = static_cast<std::size_t>(fileSize);
+    const unsigned char* mappedData = nullptr;
+
+    // The handles can be closed right away, the mapping keeps the file open
+#ifdef _WIN32
+    HANDLE file = CreateFileA(fn.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        return nullptr;
+    }
+
+    HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    CloseHandle(file);
+
+    if (!mapping)
+    {
+        return nullptr;
+    }
+
+    mappedData = static_cast<const unsigned char*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+    CloseHandle(mapping);
+
+    if (!mappedData)
+    {
+        return nullptr;
+    }
+#else
+    int file = ::open(fn.c_str(), O_RDONLY);
+
+    if (file < 0)
+    {
+        return nullptr;
+    }
+
+    void* mapping = mmap(nullptr, bytes, PROT_READ, MAP_SHARED, file, 0);
+    ::close(file);
+
+    if (mapping == MAP_FAILED)
+    {
+        return nullptr;
+    }
+
+    mappedData = static_cast<const unsigned char*>(mapping);
+#endif
+
+    std::unique_ptr<MappedFrameStack> stack(new MappedFrameStack(mappedData, bytes));
+    const FrameStackHeader& found = stack->header;
+
+    if (std::memcmp(found.magic, expected.magic, sizeof(found.magic)) != 0 || found.version != expected.version
+        || found.width != expected.width || found.height != expected.height || found.channels != expected.channels
+        || found.sampleBytes != expected.sampleBytes || found.frames != expected.frames
+        || found.fingerprint != expected.fingerprint || found.tileRows < 1 || found.tileRows > found.height)
+    {
+        return nullptr;
+    }
+
+    return stack;
+}
+
+int MappedFrameStack::frameCount() const
+{
+    return static_cast<int>(header.frames);
+}
+
+const unsigned char* MappedFrameStack::readFrame(int index, std::vector<unsigned char>& buffer)
+{
+    FrameRows frame;
+    frame.width = header.width;
+    frame.height = header.height;
+    frame.channels = header.channels;
+    frame.sampleBytes = header.sampleBytes;
+    frame.firstRow = 0;
+    frame.rows = header.height;
+
+    return readRows(index, frame, buffer);
+}
+
+// Bands that match a tile are returned straight from the mapping,
+// other bands are gathered from the tiles they overlap
+const unsigned char* MappedFrameStack::readRows(int index, const FrameRows& band, std::vector<unsigned char>& buffer)
+{
+    int tileRows = static_cast<int>(header.tileRows);
+    int firstTile = band.firstRow / tileRows;
+
+    if (band.firstRow % tileRows == 0 && band.rows == tileRowCount(firstTile))
+    {
+        return tileData(index, firstTile);
+    }
+
+    std::size_t rowBytes = static_cast<std::size_t>(header.width) * header.sampleBytes;
+    std::size_t bandPlane = rowBytes * band.rows;
+    int lastRow = band.firstRow + band.rows;
+
+    buffer.resize(header.channels * bandPlane);
+
+    for (int row = band.firstRow; row < lastRow; )
+    {
+        int tile = row / tileRows;
+        int tileFirstRow = tile * tileRows;
+        int rows = std::min(lastRow, tileFirstRow + tileRowCount(tile)) - row;
+        const unsigned char* tileStart = tileData(index, tile);
+
+        for (std::uint32_t channel = 0; channel < header.channels; channel++)
+        {
+            std::memcpy(buffer.data() + channel * bandPlane + (row - band.firstRow) * rowBytes,
+                tileStart + (channel * tileRowCount(tile) + row - tileFirstRow) * rowBytes, rows * rowBytes);
+        }
+
+        row += rows;
+    }
+
+    return buffer.data();
+}
+
+bool MappedFrameStack::readsRows() const
+{
+    return true;
+}
+
+// Start of a frame within a tile
+const unsigned char* MappedFrameStack::tileData(int index, int tile) const
+{
+    std::size_t rowBytes = static_cast<std::size_t>(header.width) * header.sampleBytes * header.channels;
+    std::size_t firstRow = static_cast<std::size_t>(tile) * header.tileRows;
+
+    return data + kHeaderBytes + firstRow * rowBytes * header.frames + static_cast<std::size_t>(index) * tileRowCount(tile) * rowBytes;
+}
+
+// Number of rows in a tile, the last tile may be shorter
+int MappedFrameStack::tileRowCount(int tile) const
+{
+    return std::min(static_cast<int>(header.tileRows), static_cast<int>(header.height) - tile * static_cast<int>(header.tileRows));
+}
@@ -0,0 +1,59 @@
+// FrameStack
+// Raw on-disk copy of a decoded image sequence, memory-mapped by later runs
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "frame_source.h"
+
+// A stack file starts with a header page, followed by the frames in tiles of tileRows rows.
+// A tile holds its rows of every frame in turn, planar by channel, so a band of the image
+// is one contiguous run per frame. With tileRows equal to the height, every frame is contiguous.
+struct FrameStackHeader {
+    char magic[8] = {};
+    std::uint32_t version = 0;
+    std::uint32_t width = 0;
+    std::uint32_t height = 0;
+    std::uint32_t channels = 0;
+    std::uint32_t sampleBytes = 0;
+    std::uint32_t frames = 0;
+    std::uint32_t tileRows = 0;
+    std::uint32_t reserved = 0;
+    std::uint64_t fingerprint = 0;
+};
+
+// Header for a stack of the given sequence, identified by the names, sizes and modification times of its files
+FrameStackHeader frameStackHeader(const std::vector<std::string>& fileNames, int width, int height, int channels, int sampleBytes, int tileRows);
+
+// Decode every frame of the source and write them to a stack file
+void writeFrameStack(const std::string& fn, FrameSource& source, const FrameStackHeader& header, int decoderThreads, int lookahead);
+
+// Frames read straight from a memory-mapped stack file, without decoding or copying
+class MappedFrameStack : public FrameSource {
+public:
+    ~MappedFrameStack();
+
+    // Map a stack file of the sequence described by the header, with any tile size.
+    // Returns nullptr if the file is missing or was written from a different sequence.
+    static std::unique_ptr<MappedFrameStack> open(const std::string& fn, const FrameStackHeader& expected);
+
+    int frameCount() const override;
+    const unsigned char* readFrame(int index, std::vector<unsigned char>& buffer) override;
+    const unsigned char* readRows(int index, const FrameRows& band, std::vector<unsigned char>& buffer) override;
+    bool readsRows() const override;
+
+private:
+    MappedFrameStack(const unsigned char* mappedData, std::size_t bytes);
+
+    const unsigned char* tileData(int index, int tile) const;
+    int tileRowCount(int tile) const;
+
+    const unsigned char* data = nullptr;
+    std::size_t mappedBytes = 0;
+    FrameStackHeader header;
+};
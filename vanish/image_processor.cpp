@@ -1,8 +1,18 @@
 // ImageProcessor
 // Class to handle the processing of the image sequence
 #include "image_processor.h"
-
+#include "frame_pipeline.h"
+#include "frame_stack.h"
+#include "processing_error.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <filesystem>
 #include <iostream>
+#include <limits>
+#include <random>
+#include <thread>
 #include <omp.h>
 #include <CImg.h>
 
@@ -11,48 +21,139 @@ namespace
     const int kDefaultWidth = 480;
     const int kDefaultHeight = 480;
     const float kDefaultConfidenceLevel = 0.2f;
-    const int kMaxBrightnessValue = 255;
+    const std::size_t kDefaultMemoryBudget = std::size_t(4096) << 20;
+    const int kDefaultLookahead = 8;
+    const std::size_t kTileBytes = 256 * 1024;
+    const int kOutputChannels = 3;
+    const char* const kWindowFileFormat = "background_%05d.png";
+    const char* const kSweepFileFormat = "%s_%g.png";
+    const unsigned int kSampleSeed = 1;
+    const int kMinSampledFrames = 3;
+    const float kOutlierAgreement = 0.5f;
+    const int kParallelPixels = 16384;
 }
 
-ImageProcessor::ImageProcessor()
+template <typename CountType, typename PixelType>
+ImageProcessor<CountType, PixelType>::ImageProcessor()
+    : silent(nullptr)
 {
     width = kDefaultWidth;
     height = kDefaultHeight;
     size = width * height;
 
     minVal = 0;
-    maxVal = kMaxBrightnessValue;
-    bucketSize = 8;
+    depth = 8 * sizeof(PixelType);
+    maxVal = (1 << depth) - 1;
+    bucketSize = 8 << (depth - 8);
     buckets = (maxVal + 1) / bucketSize;
 
-    confLevel = kDefaultConfidenceLevel;
+    confLevels.assign(1, kDefaultConfidenceLevel);
+    memoryBudget = kDefaultMemoryBudget;
+    decoderThreads = std::max(static_cast<int>(std::thread::hardware_concurrency()), 1);
+    lookahead = kDefaultLookahead;
+    layout = BucketLayout::PixelMajor;
 }
 
-ImageProcessor::~ImageProcessor() 
+template <typename CountType, typename PixelType>
+ImageProcessor<CountType, PixelType>::~ImageProcessor() 
 {
 }
 
 // Set input file sequence
-void ImageProcessor::setFiles(const std::vector<std::string>& fn)
+template <typename CountType, typename PixelType>
+void ImageProcessor<CountType, PixelType>::setFiles(const std::vector<std::string>& fn)
 {
     fileNames = fn;
+    streaming = false;
+
+    metrics = ProcessorMetrics();
+    runStart = std::chrono::steady_clock::now();
 
     inferParameters();
+
+    // Every pass reads the frames through the cache or the frame stack, so each file is decoded only once
+    std::unique_ptr<FrameSource> files(new FileFrameSource(fileNames, width, height, channels, sizeof(PixelType)));
+
+    if (!frameStackFile.empty())
+    {
+        frameSource = openFrameStack(std::move(files));
+    }
+    else
+    {
+        frameSource.reset(new FrameCache(std::move(files), static_cast<std::size_t>(size) * channels * sizeof(PixelType), frameCacheBudget()));
+    }
+
+    if (sampleCount > 0)
+    {
+        rejectBadFrames();
+    }
+
+    initializeData();
+}
+
+// Use frames from another source than image files, such as generated test sequences
+template <typename CountType, typename PixelType>
+void ImageProcessor<CountType, PixelType>::setFrameSource(std::unique_ptr<FrameSource> source, int newWidth, int newHeight, int newChannels)
+{
+    frameSource = std::move(source);
+    streaming = false;
+
+    metrics = ProcessorMetrics();
+    runStart = std::chrono::steady_clock::now();
+
+    frames = frameSource->frameCount();
+    width = newWidth;
+    height = newHeight;
+    size = width * height;
+    channels = newChannels;
+
+    printImageData();
     initializeData();
 }
 
+// Map the frame stack of the sequence, writing it first if there is none or it is out of date.
+// The stack is tiled in the bands of the current memory limit, so bands are read without copying.
+template <typename CountType, typename PixelType>
+std::unique_ptr<FrameSource> ImageProcessor<CountType, PixelType>::openFrameStack(std::unique_ptr<FrameSource> files)
+{
+    FrameStackHeader header = frameStackHeader(fileNames, width, height, channels, sizeof(PixelType), planBandRows());
+    std::unique_ptr<FrameSource> stack = MappedFrameStack::open(frameStackFile, header);
+
+    if (stack)
+    {
+        log() << std::endl << "Reading frames from " << frameStackFile << std::endl;
+        return stack;
+    }
+
+    log() << std::endl << "Writing frames to " << frameStackFile << std::endl;
+
+    {
+        PhaseTimer timer(metrics.decodeSeconds);
+        writeFrameStack(frameStackFile, *files, header, decoderThreads, lookahead);
+    }
+
+    stack = MappedFrameStack::open(frameStackFile, header);
+
+    if (!stack)
+    {
+        throw ProcessingError("Failed to map frame stack file " + frameStackFile + "!");
+    }
+
+    return stack;
+}
+
 // Infer processor parameters from the first file
-void ImageProcessor::inferParameters()
+template <typename CountType, typename PixelType>
+void ImageProcessor<CountType, PixelType>::inferParameters()
 {
     if (fileNames.size() <= 0) 
     {
-        std::cerr << "Image list empty. Exiting." << std::endl;
-        exit(EXIT_FAILURE);
+        throw ProcessingError("Image list empty.");
     }
 
     frames = static_cast<int>(fileNames.size());
 
-    cimg_library::CImg<unsigned char> inspectImage(fileNames[0].c_str());
+    cimg_library::CImg<PixelType> inspectImage(fileNames[0].c_str());
     width = inspectImage.width();
     height = inspectImage.height();
     size = width * height;
@@ -62,434 +163,2116 @@ void ImageProcessor::inferParameters()
 }
 
 // Print data about the image and the current settings
-void ImageProcessor::printImageData() const
+template <typename CountType, typename PixelType>
+void ImageProcessor<CountType, PixelType>::printImageData() const
 {
-    std::cout << "Image data" << std::endl;
-    std::cout << "\tFrames:\t\t" << frames << std::endl;
-    std::cout << "\tWidth:\t\t" << width << std::endl;
-    std::cout << "\tHeight:\t\t" << height << std::endl;
-    std::cout << "\tChannels:\t" << channels << std::endl << std::endl;
+    log() << "Image data" << std::endl;
+    log() << "\tFrames:\t\t" << frames << std::endl;
+    log() << "\tWidth:\t\t" << width << std::endl;
+    log() << "\tHeight:\t\t" << height << std::endl;
+    log() << "\tChannels:\t" << channels << std::endl;
+    log() << "\tDepth:\t\t" << depth << " bit" << std::endl << std::endl;
+
+    log() << "Settings" << std::endl;
+    log() << "\tBuckets:\t" << buckets << std::endl;
+    log() << "\tBucket size:\t" << bucketSize << std::endl;
+    log() << "\tCounters:\t" << sizeof(BucketType) * 8 << " bit" << std::endl;
+    log() << "\tConfidence:\t";
+
+    for (std::size_t level = 0; level < confLevels.size(); level++)
+    {
+        log() << (level > 0 ? ", " : "") << confLevels[level];
+    }
 
-    std::cout << "Settings" << std::endl;
-    std::cout << "\tBuckets:\t" << buckets << std::endl;
-    std::cout << "\tBucket size:\t" << bucketSize << std::endl;
-    std::cout << "\tConfidence:\t" << confLevel << std::endl;
-}
+    log() << std::endl;
 
-// Set up the data structure to store bucket information
-void ImageProcessor::initializeData()
-{
-    for (int i = 0; i < channels; i++)
+    if (frameStackFile.empty())
     {
-        bucketData.push_back(BucketData<BucketType>(width, height, buckets));
+        log() << "\tFrame cache:\t" << (frameCacheBudget() >> 20) << " MB" << std::endl;
+    }
+    else
+    {
+        log() << "\tFrame stack:\t" << frameStackFile << std::endl;
     }
-}
-
-// Set the size of a bucket in terms of color intensity values
-void ImageProcessor::setBucketSize(int newSize)
-{
-    bucketSize = newSize;
-    buckets = (maxVal + 1) / bucketSize;
-}
 
-// Set the confidence level as bucket hits / framecount
-void ImageProcessor::setConfidenceLevel(float newConf) 
-{
-    confLevel = newConf;
-}
+    if (maxMemory > 0)
+    {
+        log() << "\tMemory limit:\t" << (maxMemory >> 20) << " MB" << std::endl;
+    }
 
-// Find the correspoding A Bucket for the color intensity value
-int ImageProcessor::getABucket(int value) const
-{
-    if (value < minVal)
+    if (!partialReaders.empty())
     {
-        return 0;
+        log() << "\tPartials:\t" << partialReaders.size() << " files" << (frameSource ? "" : ", no frames, both passes from the bucket sums") << std::endl;
     }
 
-    if (value > maxVal)
+    if (!partialFile.empty())
     {
-        return buckets - 1;
+        log() << "\tPartial file:\t" << partialFile << (compressPartial ? " (compressed)" : "") << std::endl;
     }
 
-    return value / bucketSize;
+    log() << "\tEstimator:\t" << (useClusters() ? "clusters" : "buckets") << std::endl;
+    log() << "\tLayout:\t\t" << (layout == BucketLayout::PixelMajor ? "pixel-major" : "bucket-major") << std::endl;
+    log() << "\tFirst pass:\t" << (useBucketSums() ? "bucket sums" : "frames") << std::endl;
+    log() << "\tKernels:\t" << simdLevelName(simdLevel()) << std::endl;
+    log() << "\tDecoders:\t" << decoderThreads << " (lookahead " << lookahead << ")" << std::endl;
 }
 
-// Find the corresponding B Bucket for the color intensity value
-int ImageProcessor::getBBucket(int value) const
+// Set up the data structure to store bucket information
+template <typename CountType, typename PixelType>
+void ImageProcessor<CountType, PixelType>::initializeData()
 {
-    value += bucketSize / 2;
+    outputs.resize(confLevels.size());
 
-    if (value < minVal)
+    for (std::size_t level = 0; level < outputs.size(); level++)
     {
-        return 0;
+        outputs[level].confLevel = confLevels[level];
+        outputs[level].reconstruction.assign(static_cast<std::size_t>(size) * kOutputChannels, 0);
+        outputs[level].confidence.assign(static_cast<std::size_t>(size) * kOutputChannels, 0);
+        outputs[level].firstPassFail = 0;
+        outputs[level].secondPassFail = 0;
     }
 
-    if (value > maxVal - bucketSize / 2)
+    setBand(0, planBandRows());
+
+    // A stream keeps the sum of the values in every bucket to average the biggest one
+    if (streaming)
     {
-        return buckets - 1;
+        bucketData.sums.assign(bucketData.counts.size(), 0);
+        streamTotal.assign(static_cast<std::size_t>(size) * channels, 0);
+
+        for (auto& entry : bucketData.finalBucket)
+        {
+            entry.isABucket = true;
+        }
     }
 
-    return value / bucketSize;
-}
+    // Tabulate the buckets of every value the pixel type can hold for the counting kernel.
+    // Values above the bit depth, such as stray bits of 12-bit data, go to the last bucket.
+    int tableSize = std::numeric_limits<PixelType>::max() + 1;
+    classifier.bucketA.resize(tableSize);
+    classifier.bucketB.resize(tableSize);
 
-// Process the image sequence and create final output
-void ImageProcessor::processSequence()
-{
-    countBuckets();
-    findBiggestBucket();
-    createFinal();
-}
+    for (int value = 0; value < tableSize; value++)
+    {
+        classifier.bucketA[value] = static_cast<PixelType>(getABucket(value));
+        classifier.bucketB[value] = static_cast<PixelType>(getBBucket(value));
+    }
 
-// Read the image files and count the pixel values into buckets
-void ImageProcessor::countBuckets()
-{
-    std::cout << std::endl << "Reading:\t";
+    // The tables never decrease, so every bucket covers one range of values.
+    // Buckets that no value maps to get an empty range.
+    classifier.lowA.assign(buckets, std::numeric_limits<PixelType>::max());
+    classifier.highA.assign(buckets, 0);
+    classifier.lowB.assign(buckets, std::numeric_limits<PixelType>::max());
+    classifier.highB.assign(buckets, 0);
 
-    // Read image frames and count the buckets
-    for (auto& file : fileNames) 
+    for (int value = 0; value < tableSize; value++)
     {
-        cimg_library::CImg<unsigned char> newImage(file.c_str());
+        int bucketA = classifier.bucketA[value];
+        int bucketB = classifier.bucketB[value];
 
-        std::cout << "|" << std::flush;
+        classifier.lowA[bucketA] = std::min(classifier.lowA[bucketA], static_cast<PixelType>(value));
+        classifier.highA[bucketA] = std::max(classifier.highA[bucketA], static_cast<PixelType>(value));
+        classifier.lowB[bucketB] = std::min(classifier.lowB[bucketB], static_cast<PixelType>(value));
+        classifier.highB[bucketB] = std::max(classifier.highB[bucketB], static_cast<PixelType>(value));
+    }
 
-#pragma omp parallel for
-        for (int i = 0; i < width; i++) 
-        {
-            for (int j = 0; j < height; j++) 
-            {
-                for (int channel = 0; channel < channels; channel++) 
-                {
-                    int pixel = newImage(i, j, 0, channel);
+    classifier.shift = -1;
+    classifier.halfBucket = bucketSize / 2;
 
-                    int a_bucket = getABucket(pixel);
-                    bucketData[channel].bucketA[i + j * width + a_bucket * size]++;
+    // The shift kernels have no clamp for values above the bit depth, so they need the full range
+    if ((bucketSize & (bucketSize - 1)) == 0 && (maxVal + 1) % bucketSize == 0 && maxVal == std::numeric_limits<PixelType>::max())
+    {
+        classifier.shift = 0;
 
-                    int b_bucket = getBBucket(pixel);
-                    bucketData[channel].bucketB[i + j * width + b_bucket * size]++;
-                }
-            }
+        while ((1 << classifier.shift) < bucketSize)
+        {
+            classifier.shift++;
         }
     }
-
-    std::cout << std::endl << "Finished reading files...";
 }
 
-// Find the biggest bucket for each pixel
-void ImageProcessor::findBiggestBucket()
+// Memory for decoded frames, at most half of the memory limit.
+// Frames mapped from a frame stack live in the page cache instead.
+template <typename CountType, typename PixelType>
+std::size_t ImageProcessor<CountType, PixelType>::frameCacheBudget() const
 {
-    std::cout << std::endl << "Finding the biggest bucket..." << std::flush;
-
-#pragma omp parallel for
-    // Find the biggest bucket
-    for (int i = 0; i < width; i++) 
+    if (!frameStackFile.empty())
     {
-        for (int j = 0; j < height; j++) 
-        {
-            int idx = i + j * width;
-
-            for (int channel = 0; channel < channels; channel++) 
-            {
-                int maxCount = 0;
-                BucketType maxBucket = 0;
-                bool maxTypeA = true;
+        return 0;
+    }
 
-                for (int bucket = 0; bucket < buckets; bucket++) 
-                {
-                    if (bucketData[channel].bucketA[i + j * width + bucket * size] > maxCount) 
-                    {
-                        maxCount = bucketData[channel].bucketA[i + j * width + bucket * size];
-                        maxBucket = static_cast<BucketType>(bucket);
-                        maxTypeA = true;
-                    }
-                    if (bucketData[channel].bucketB[i + j * width + bucket * size] > maxCount) 
-                    {
-                        maxCount = bucketData[channel].bucketB[i + j * width + bucket * size];
-                        maxBucket = static_cast<BucketType>(bucket);
-                        maxTypeA = false;
-                    }
-                }
+    // The cluster estimator reads every frame once, and a merge without frames reads none
+    if (useClusters() || (!partialReaders.empty() && !frameSource))
+    {
+        return 0;
+    }
 
-                bucketData[channel].finalBucket[idx].id = maxBucket;
-                bucketData[channel].finalBucket[idx].isABucket = maxTypeA;
-                bucketData[channel].finalBucket[idx].diff = maxCount;
-            }
-        }
+    if (maxMemory == 0)
+    {
+        return memoryBudget;
     }
+
+    return std::min(memoryBudget, maxMemory / 2);
 }
 
-void ImageProcessor::printPixelInformation(int x, int y) const
+// Rows per band so that the frame cache, the decode buffers, the output images
+// and the per-pixel state of one band stay within the memory limit
+template <typename CountType, typename PixelType>
+int ImageProcessor<CountType, PixelType>::planBandRows() const
 {
-    int idx = x + y * width;
+    if (maxMemory == 0 || streaming)
+    {
+        return height;
+    }
 
-    std::cout << std::endl << "Pixel information for " << x << ", " << y << std::endl;
+    // The first band decodes whole frames, and the output images always cover the whole frame
+    std::size_t frameBytes = static_cast<std::size_t>(size) * channels * sizeof(PixelType);
+    std::size_t fixedBytes = frameCacheBudget() + static_cast<std::size_t>(lookahead + decoderThreads) * frameBytes
+        + static_cast<std::size_t>(size) * kOutputChannels * (sizeof(PixelType) + 1);
 
-    std::cout << std::endl << "\tA Buckets: ";
-    for (int bucket = 0; bucket < buckets; bucket++)
+    std::size_t bucketBytes = sizeof(BucketType) + (useBucketSums() ? sizeof(SumType) : 0);
+    std::size_t pixelBytes = channels * (2 * buckets * bucketBytes + sizeof(BucketEntry<BucketId>) + 2 * sizeof(BucketId) + 2 * sizeof(float)) + sizeof(int) + 2;
+
+    if (useClusters())
     {
-        std::cout << static_cast<int>(bucketData[0].bucketA[idx + bucket * size]) << " ";
+        pixelBytes = ClusterSketch<CountType, PixelType>::pixelBytes(channels);
     }
 
-    std::cout << std::endl << "\tB Buckets: ";
-    for (int bucket = 0; bucket < buckets; bucket++)
+    std::size_t rowBytes = pixelBytes * width;
+
+    if (maxMemory < fixedBytes + rowBytes)
     {
-        std::cout << static_cast<int>(bucketData[0].bucketB[idx + bucket * size]) << " ";
+        std::cerr << "Memory limit too small for the frame buffers and output images. Using one row per band." << std::endl;
+        return 1;
     }
 
-    std::cout << std::endl;
+    return static_cast<int>(std::min((maxMemory - fixedBytes) / rowBytes, static_cast<std::size_t>(height)));
 }
 
-void ImageProcessor::firstPass(vec2d& acc, vec2d& total, std::vector<int>& count) const
+// Select the rows processed by the passes and allocate the bucket data for them.
+// Bands other than the whole image read their rows through a FrameBand.
+template <typename CountType, typename PixelType>
+void ImageProcessor<CountType, PixelType>::setBand(int firstRow, int rows)
 {
-    std::cout << std::endl << "1st pass:\t";
+    bandFirstRow = firstRow;
+    bandRows = rows;
+    bandSize = width * rows;
 
-    for (auto& file : fileNames)
+    // The cluster estimator keeps no histograms
+    if (useClusters())
     {
-        cimg_library::CImg<unsigned char> newImage(file.c_str());
+        sketch.reset(width, bandRows, channels);
 
-        std::cout << "|" << std::flush;
+        std::size_t sketchBytes = sketch.colors.size() * sizeof(PixelType) + sketch.weights.size() * sizeof(CountType);
+        metrics.bucketBytes = std::max(metrics.bucketBytes, sketchBytes);
+    }
+    else
+    {
+        // The counters of the previous band or sequence are reused when they are large enough
+        bucketData.reset(width, bandRows, channels, buckets, layout);
 
-#pragma omp parallel for
-        for (int i = 0; i < width; i++) 
+        if (useBucketSums())
         {
-            for (int j = 0; j < height; j++) 
-            {
-                int idx = i + j * width;
-                int hits = 0;
+            bucketData.sums.assign(bucketData.counts.size(), 0);
+        }
 
-                for (int channel = 0; channel < channels; channel++) 
-                {
-                    int pixel = newImage(i, j, 0, channel);
+        std::size_t bucketBytes = bucketData.counts.size() * sizeof(BucketType) + bucketData.sums.size() * sizeof(SumType)
+            + bucketData.finalBucket.size() * sizeof(BucketEntry<BucketId>)
+            + (bucketData.modes.low.size() + bucketData.modes.high.size()) * sizeof(BucketId) + bucketData.modes.keyChannel.size();
+        metrics.bucketBytes = std::max(metrics.bucketBytes, bucketBytes);
+    }
 
-                    total[channel][idx] += pixel;
+    bandSource.reset();
 
-                    BucketEntry<unsigned char> entry = bucketData[channel].finalBucket[idx];
+    if (bandRows < height && frameSource)
+    {
+        FrameRows band;
+        band.width = width;
+        band.height = height;
+        band.channels = channels;
+        band.sampleBytes = sizeof(PixelType);
+        band.firstRow = bandFirstRow;
+        band.rows = bandRows;
+
+        bandSource.reset(new FrameBand(*frameSource, band));
+    }
+}
 
-                    if (entry.isABucket && entry.id != getABucket(pixel))
-                    {
-                        continue;
-                    }
+// Frames of the current band
+template <typename CountType, typename PixelType>
+FrameSource& ImageProcessor<CountType, PixelType>::bandFrames() const
+{
+    return bandSource ? *bandSource : *frameSource;
+}
 
-                    if (!entry.isABucket && entry.id != getBBucket(pixel))
-                    {
-                        continue;
-                    }
+// Set the size of a bucket in terms of color intensity values
+template <typename CountType, typename PixelType>
+void ImageProcessor<CountType, PixelType>::setBucketSize(int newSize)
+{
+    bucketSize = newSize;
+    buckets = (maxVal + 1) / bucketSize;
+}
 
-                    hits++;
-                }
+// Set the number of significant bits of the input values, up to the width of the pixel type.
+// 10 and 12-bit data is kept in the low bits of 16-bit samples.
+template <typename CountType, typename PixelType>
+void ImageProcessor<CountType, PixelType>::setBitDepth(int newDepth)
+{
+    depth = std::min(newDepth, static_cast<int>(8 * sizeof(PixelType)));
+    maxVal = (1 << depth) - 1;
+    buckets = (maxVal + 1) / bucketSize;
+}
 
-                if (hits == channels) 
-                {
-                    for (int k = 0; k < channels; k++) 
-                    {
-                        acc[k][idx] += newImage(i, j, 0, k);
-                    }
+// Set the number of pixel samples compared between frames to find bad frames, zero to keep every frame
+template <typename CountType, typename PixelType>
+void ImageProcessor<CountType, PixelType>::setSampleCount(int newSamples)
+{
+    sampleCount = newSamples;
+}
 
-                    count[idx]++;
-                }
-            }
-        }
-    }
+// Set the confidence level as bucket hits / framecount
+template <typename CountType, typename PixelType>
+void ImageProcessor<CountType, PixelType>::setConfidenceLevel(float newConf) 
+{
+    confLevels.assign(1, newConf);
 }
 
-void ImageProcessor::countFailed(vec2d& acc, std::vector<int>& count, std::vector<bool>& cleared, int confFrames, int& failed) const
+// Set several confidence levels, each with its own output images from the same passes.
+// The streaming modes and the viewer use the first level.
+template <typename CountType, typename PixelType>
+void ImageProcessor<CountType, PixelType>::setConfidenceLevels(const std::vector<float>& newConfs)
 {
-#pragma omp parallel for
-    for (int i = 0; i < width; i++) 
+    confLevels = newConfs;
+
+    if (confLevels.empty())
     {
-        for (int j = 0; j < height; j++) 
-        {
-            int idx = i + j * width;
+        confLevels.assign(1, kDefaultConfidenceLevel);
+    }
+}
 
-            if (count[idx] < confFrames) 
-            {
-                failed++;
-                count[idx] = 0;
+// Set the amount of memory used to keep decoded frames between passes
+// Frames that do not fit are spilled to a scratch file
+template <typename CountType, typename PixelType>
+void ImageProcessor<CountType, PixelType>::setMemoryBudget(std::size_t bytes)
+{
+    memoryBudget = bytes;
+}
 
-                for (int channel = 0; channel < channels; channel++) 
-                {
-                    acc[channel][idx] = 0.0f;
-                }
-            }
-            else
-            {
-                cleared[idx] = true;
-            }
-        }
-    }
+// Set the memory order of the bucket counters
+template <typename CountType, typename PixelType>
+void ImageProcessor<CountType, PixelType>::setBucketLayout(BucketLayout newLayout)
+{
+    layout = newLayout;
 }
 
-void ImageProcessor::secondPass(vec2d& acc, std::vector<int>& count, std::vector<bool>& cleared) const
+// Limit the peak memory use. The image is then processed in bands of rows,
+// running every pass on one band before moving to the next. Zero means no limit.
+template <typename CountType, typename PixelType>
+void ImageProcessor<CountType, PixelType>::setMaxMemory(std::size_t bytes)
 {
-    std::cout << std::endl << "2nd pass:\t";
+    maxMemory = bytes;
+}
 
-    for (auto& file : fileNames)
-    {
-        cimg_library::CImg<unsigned char> newImage(file.c_str());
+// Keep the decoded frames in a raw stack file, written on the first run and
+// memory-mapped by later runs on the same files. An empty name turns the stack off.
+template <typename CountType, typename PixelType>
+void ImageProcessor<CountType, PixelType>::setFrameStack(const std::string& fn)
+{
+    frameStackFile = fn;
+}
 
-        std::cout << "|" << std::flush;
+// Write the phase times and memory use of every run to a JSON file. An empty name writes no file.
+template <typename CountType, typename PixelType>
+void ImageProcessor<CountType, PixelType>::setMetricsFile(const std::string& fn)
+{
+    metricsFile = fn;
+}
 
-#pragma omp parallel for
-        for (int i = 0; i < width; i++) 
-        {
-            for (int j = 0; j < height; j++) 
-            {
-                int idx = i + j * width;
+// Write the bucket counts and sums of the sequence to a partial file instead of creating the output.
+// Partials of several parts of one sequence are added together by mergePartials. An empty name
+// creates the output as usual.
+template <typename CountType, typename PixelType>
+void ImageProcessor<CountType, PixelType>::setPartialFile(const std::string& fn, bool compress)
+{
+    partialFile = fn;
+    compressPartial = compress;
+}
 
-                if (cleared[idx])
-                {
-                    continue;
-                }
+// Keep the sum of the values of every bucket while counting, and take the first pass from the sums
+// of the biggest buckets instead of reading every frame again. The sums take four bytes per bucket,
+// eight with 32-bit counters.
+template <typename CountType, typename PixelType>
+void ImageProcessor<CountType, PixelType>::setBucketSums(bool newBucketSums)
+{
+    bucketSums = newBucketSums;
+}
 
-                int maxDiff = -1;
-                int maxChannel = -1;
+// Select the estimator of the background, the bucket histograms or the per-pixel clusters
+template <typename CountType, typename PixelType>
+void ImageProcessor<CountType, PixelType>::setEstimator(Estimator newEstimator)
+{
+    estimator = newEstimator;
+}
 
-                std::vector<BucketEntry<unsigned char>> entry(channels);
-                std::vector<int> pixel(channels);
+// Only write the output files, without opening the viewer windows
+template <typename CountType, typename PixelType>
+void ImageProcessor<CountType, PixelType>::setHeadless(bool newHeadless)
+{
+    headless = newHeadless;
+}
 
-                for (int channel = 0; channel < channels; channel++) 
-                {
-                    entry[channel] = bucketData[channel].finalBucket[idx];
-                    pixel[channel] = newImage(i, j, 0, channel);
+// Leave out the progress output, for running several sequences at once
+template <typename CountType, typename PixelType>
+void ImageProcessor<CountType, PixelType>::setQuiet(bool newQuiet)
+{
+    quiet = newQuiet;
+}
 
-                    if (entry[channel].diff > maxDiff) 
-                    {
-                        maxDiff = entry[channel].diff;
-                        maxChannel = channel;
-                    }
-                }
+// Set the directory the output images are written to, the working directory by default
+template <typename CountType, typename PixelType>
+void ImageProcessor<CountType, PixelType>::setOutputDirectory(const std::string& directory)
+{
+    outputDirectory = directory;
+}
 
-                BucketEntry<unsigned char> maxEntry = entry[maxChannel];
+// Apply all options shared by the sequences of a run
+template <typename CountType, typename PixelType>
+void ImageProcessor<CountType, PixelType>::setSettings(const ProcessorSettings& settings)
+{
+    setBitDepth(settings.depth);
+    setBucketSize(settings.bucketSize);
+    setConfidenceLevels(settings.confLevels);
+    setSampleCount(settings.samples);
+    setMemoryBudget(settings.memoryBudget);
+    setDecoderThreads(settings.decoderThreads, settings.lookahead);
+    setBucketLayout(settings.layout);
+    setBucketSums(settings.bucketSums);
+    setEstimator(settings.estimator);
+    setMaxMemory(settings.maxMemory);
+    setHeadless(settings.headless);
+    setFrameStack(settings.frameStack);
+    setMetricsFile(settings.metricsFile);
+    setPartialFile(settings.partialFile, settings.compressPartial);
+}
 
-                if (maxEntry.isABucket && maxEntry.id != getABucket(pixel[maxChannel]))
-                {
-                    continue;
-                }
+// Stream for progress output
+template <typename CountType, typename PixelType>
+std::ostream& ImageProcessor<CountType, PixelType>::log() const
+{
+    return quiet ? silent : std::cout;
+}
 
-                if (!maxEntry.isABucket && maxEntry.id != getBBucket(pixel[maxChannel]))
-                {
-                    continue;
-                }
+// Set the number of threads decoding frames ahead of the pixel passes,
+// and how many decoded frames they may keep ready
+template <typename CountType, typename PixelType>
+void ImageProcessor<CountType, PixelType>::setDecoderThreads(int threads, int frameLookahead)
+{
+    decoderThreads = threads;
+    lookahead = frameLookahead;
+}
 
-                for (int channel = 0; channel < channels; channel++) 
-                {
-                    acc[channel][idx] += pixel[channel];
-                }
+// Find the correspoding A Bucket for the color intensity value
+template <typename CountType, typename PixelType>
+int ImageProcessor<CountType, PixelType>::getABucket(int value) const
+{
+    if (value < minVal)
+    {
+        return 0;
+    }
 
-                count[idx]++;
-            }
-        }
+    if (value > maxVal)
+    {
+        return buckets - 1;
     }
+
+    // The last bucket also takes the values above it when the bucket size does not divide the range
+    return std::min(value / bucketSize, buckets - 1);
 }
 
-void ImageProcessor::drawImages(vec2d& acc, vec2d& total, std::vector<int> count, int confFrames, int& firstPassFail, int& secondPassFail) const
+// Find the corresponding B Bucket for the color intensity value
+template <typename CountType, typename PixelType>
+int ImageProcessor<CountType, PixelType>::getBBucket(int value) const
 {
-    // Paint the final result in a window
-    cimg_library::CImg<unsigned char> reconstructionImage(width, height, 1, 3, 0);
-    cimg_library::CImgDisplay mainDisp(width, height, "Reconstructed background");
-
-    // Paint the confidence mask
-    cimg_library::CImg<unsigned char> confidenceImage(width, height, 1, 3, 0);
-    cimg_library::CImgDisplay auxDisp(width, height, "Confidence mask");
+    value += bucketSize / 2;
 
-    for (int i = 0; i < width; i++) 
+    if (value < minVal)
     {
-#pragma omp parallel for
-        for (int j = 0; j < height; j++) 
-        {
-            int idx = i + j * width;
+        return 0;
+    }
 
-            reconstructionImage(i, j, 0, 0) = static_cast<unsigned char>(acc[0][idx] / count[idx]);
-            reconstructionImage(i, j, 0, 1) = static_cast<unsigned char>(acc[1][idx] / count[idx]);
-            reconstructionImage(i, j, 0, 2) = static_cast<unsigned char>(acc[2][idx] / count[idx]);
+    if (value > maxVal - bucketSize / 2)
+    {
+        return buckets - 1;
+    }
 
-            int confidence = static_cast<int>(count[i + j * width] * (256.0f / frames));
-            confidence = std::min(confidence, 255);
+    return std::min(value / bucketSize, buckets - 1);
+}
 
-            confidenceImage(i, j, 0, 0) = static_cast<unsigned char>(confidence);
-            confidenceImage(i, j, 0, 1) = static_cast<unsigned char>(confidence);
-            confidenceImage(i, j, 0, 2) = static_cast<unsigned char>(confidence);
+// Drop frames that disagree with most of the sequence, such as exposure jumps, camera bumps
+// or blank frames. Every frame is compared at a random sample of positions against the
+// biggest bucket of each position over the whole sequence, and frames that hit it at less
+// than half the median rate are left out of the passes. The frames are read through the
+// frame cache, so the frames that are kept are not decoded again.
+template <typename CountType, typename PixelType>
+void ImageProcessor<CountType, PixelType>::rejectBadFrames()
+{
+    // Two frames have no majority to compare against
+    if (frames < kMinSampledFrames)
+    {
+        return;
+    }
 
-            if (count[idx] < confFrames) 
-            {
-                secondPassFail++;
+    PhaseTimer timer(metrics.samplingSeconds);
 
-                confidenceImage(i, j, 0, 0) = 255;
-                confidenceImage(i, j, 0, 1) /= 2;
-                confidenceImage(i, j, 0, 2) /= 2;
+    log() << std::endl << "Sampling:\t";
 
-                for (int channel = 0; channel < channels; channel++) 
-                {
-                    float val = static_cast<float>(total[channel][idx]) / frames;
-                    reconstructionImage(i, j, 0, channel) = static_cast<unsigned char>(val);
-                }
-            }
-        }
+    std::size_t planeSize = static_cast<std::size_t>(size) * channels;
+    int positions = static_cast<int>(std::min(static_cast<std::size_t>(sampleCount), planeSize));
 
-        auxDisp.render(confidenceImage);
-        auxDisp.paint();
+    std::mt19937 random(kSampleSeed);
+    std::uniform_int_distribution<std::size_t> position(0, planeSize - 1);
+    std::vector<std::size_t> samplePositions(positions);
 
-        mainDisp.render(reconstructionImage);
-        mainDisp.paint();
+    for (auto& samplePosition : samplePositions)
+    {
+        samplePosition = position(random);
     }
 
-    // Write the final color image to file
-    std::remove("output.png");
-    reconstructionImage.save_png("output.png");
+    std::vector<int> values(static_cast<std::size_t>(frames) * positions);
+    FramePipeline pipeline(*frameSource, decoderThreads, lookahead);
 
-    // Write out the confidence mask
-    std::remove("confidence.png");
-    confidenceImage.save_png("confidence.png");
+    for (int frame = 0; frame < frames; frame++)
+    {
+        const PixelType* newImage = reinterpret_cast<const PixelType*>(pipeline.next());
 
-    std::cout << std::endl;
-    std::cout << std::endl << "Processing finished." << std::endl;
-    std::cout << std::endl << "1st pass failed pixels: " << firstPassFail;
-    std::cout << std::endl << "2nd pass failed pixels: " << secondPassFail << std::endl;
+        for (int sample = 0; sample < positions; sample++)
+        {
+            values[static_cast<std::size_t>(frame) * positions + sample] = newImage[samplePositions[sample]];
+        }
 
-    std::cout << std::endl;
+        log() << "|" << std::flush;
+    }
 
-    while (!mainDisp.is_closed()) 
+    recordDecode(pipeline);
+
+    // Count the frames that fall into the biggest bucket of every sample
+    std::vector<int> agreement(frames, 0);
+    std::vector<int> countA(buckets);
+    std::vector<int> countB(buckets);
+
+    for (int sample = 0; sample < positions; sample++)
+    {
+        std::fill(countA.begin(), countA.end(), 0);
+        std::fill(countB.begin(), countB.end(), 0);
+
+        for (int frame = 0; frame < frames; frame++)
+        {
+            int value = values[static_cast<std::size_t>(frame) * positions + sample];
+
+            countA[getABucket(value)]++;
+            countB[getBBucket(value)]++;
+        }
+
+        // Ties go to the earlier bucket in the order A0, B0, A1, B1, ...
+        int biggest = 0;
+        bool isABucket = true;
+        int biggestCount = countA[0];
+
+        for (int bucket = 0; bucket < buckets; bucket++)
+        {
+            if (countA[bucket] > biggestCount)
+            {
+                biggest = bucket;
+                isABucket = true;
+                biggestCount = countA[bucket];
+            }
+
+            if (countB[bucket] > biggestCount)
+            {
+                biggest = bucket;
+                isABucket = false;
+                biggestCount = countB[bucket];
+            }
+        }
+
+        for (int frame = 0; frame < frames; frame++)
+        {
+            int value = values[static_cast<std::size_t>(frame) * positions + sample];
+
+            agreement[frame] += (isABucket ? getABucket(value) : getBBucket(value)) == biggest;
+        }
+    }
+
+    std::vector<int> sorted = agreement;
+    std::nth_element(sorted.begin(), sorted.begin() + frames / 2, sorted.end());
+    float threshold = kOutlierAgreement * sorted[frames / 2];
+
+    std::vector<int> kept;
+    std::vector<std::string> keptNames;
+
+    for (int frame = 0; frame < frames; frame++)
+    {
+        if (agreement[frame] >= threshold)
+        {
+            kept.push_back(frame);
+            keptNames.push_back(fileNames[frame]);
+        }
+        else
+        {
+            log() << std::endl << "Skipping bad frame " << fileNames[frame] << " (" << agreement[frame] << "/" << positions << " samples agree)";
+        }
+    }
+
+    if (static_cast<int>(kept.size()) == frames)
+    {
+        log() << std::endl << "No bad frames found";
+        return;
+    }
+
+    log() << std::endl << "Skipped " << frames - kept.size() << " of " << frames << " frames";
+
+    fileNames = keptNames;
+    frames = static_cast<int>(kept.size());
+    frameSource.reset(new FrameSubset(std::move(frameSource), kept));
+}
+
+// Split the image into tiles of whole rows, sized so that the data a kernel touches
+// for one tile fits in cache, and run the kernel on the tiles in parallel
+template <typename CountType, typename PixelType>
+template <typename Kernel>
+void ImageProcessor<CountType, PixelType>::forEachTile(int pixelBytes, Kernel kernel) const
+{
+    std::size_t rowBytes = static_cast<std::size_t>(std::max(pixelBytes, 1)) * width;
+    int tileRows = static_cast<int>(std::max(kTileBytes / rowBytes, std::size_t(1)));
+    int tiles = (bandRows + tileRows - 1) / tileRows;
+
+#pragma omp parallel for schedule(dynamic)
+    for (int tile = 0; tile < tiles; tile++)
+    {
+        int firstRow = tile * tileRows;
+        kernel(firstRow, std::min(firstRow + tileRows, bandRows));
+    }
+}
+
+// Process the image sequence and create final output
+template <typename CountType, typename PixelType>
+void ImageProcessor<CountType, PixelType>::processSequence()
+{
+    int rowsPerBand = bandRows;
+
+    // A partial file keeps the bucket sums, for merges without the frames
+    if (!partialFile.empty())
+    {
+        partialWriter.reset(new PartialWriter(partialFile, partialHeader(width, height, channels, depth, bucketSize, buckets, frames, compressPartial)));
+    }
+
+    for (int firstRow = 0; firstRow < height; firstRow += rowsPerBand)
+    {
+        if (firstRow != bandFirstRow)
+        {
+            setBand(firstRow, std::min(rowsPerBand, height - firstRow));
+        }
+
+        if (bandRows < height)
+        {
+            log() << std::endl << std::endl << "Rows " << bandFirstRow << " - " << bandFirstRow + bandRows - 1 << " of " << height;
+        }
+
+        if (useClusters())
+        {
+            estimateClusters();
+        }
+        else
+        {
+            if (partialReaders.empty())
+            {
+                countBuckets();
+            }
+            else
+            {
+                mergePartialBand();
+            }
+
+            if (partialWriter)
+            {
+                writePartialBand();
+            }
+            else
+            {
+                findBiggestBucket();
+                createFinal();
+            }
+        }
+
+        metrics.bands++;
+    }
+
+    if (partialWriter)
+    {
+        partialWriter->close();
+        partialWriter.reset();
+
+        finishMetrics(frames);
+
+        log() << std::endl << std::endl << "Wrote the partial histograms of " << frames << " frames to " << partialFile << "." << std::endl;
+        log() << std::endl;
+        printMetrics(log(), metrics);
+        log() << std::endl;
+
+        return;
+    }
+
+    {
+        PhaseTimer timer(metrics.outputSeconds);
+        saveImages();
+    }
+
+    finishMetrics(frames);
+
+    log() << std::endl;
+    log() << std::endl << "Processing finished." << std::endl;
+
+    for (const auto& output : outputs)
+    {
+        if (outputs.size() > 1)
+        {
+            log() << std::endl << "Confidence " << output.confLevel << ":";
+        }
+
+        log() << std::endl << "1st pass failed pixels: " << output.firstPassFail;
+        log() << std::endl << "2nd pass failed pixels: " << output.secondPassFail << std::endl;
+    }
+
+    log() << std::endl;
+    printMetrics(log(), metrics);
+    log() << std::endl;
+
+    if (!headless)
+    {
+        showImages();
+    }
+}
+
+// Read the image files and count the pixel values into buckets
+template <typename CountType, typename PixelType>
+void ImageProcessor<CountType, PixelType>::countBuckets()
+{
+    PhaseTimer timer(metrics.countSeconds);
+
+    log() << std::endl << "Reading:\t";
+
+    FramePipeline pipeline(bandFrames(), decoderThreads, lookahead);
+
+    int pixelBytes = channels * static_cast<int>(sizeof(PixelType) + 2 * buckets * (sizeof(BucketType) + (bucketData.sums.empty() ? 0 : sizeof(SumType))));
+
+    // Read image frames and count the buckets
+    for (int frame = 0; frame < frames; frame++) 
+    {
+        const PixelType* newImage = reinterpret_cast<const PixelType*>(pipeline.next());
+
+        log() << "|" << std::flush;
+
+        // Rows never share counters, so tiles are counted in parallel
+        forEachTile(pixelBytes, [&](int firstRow, int lastRow)
+        {
+            for (int j = firstRow; j < lastRow; j++) 
+            {
+                countBucketRow(bucketData, classifier, newImage, bandSize, channels, static_cast<std::size_t>(j) * width, width);
+            }
+        });
+    }
+
+    recordDecode(pipeline);
+
+    log() << std::endl << "Finished reading files...";
+}
+
+// Write the counts and sums of the band to the partial file, row by row in the order of the file
+template <typename CountType, typename PixelType>
+void ImageProcessor<CountType, PixelType>::writePartialBand()
+{
+    PhaseTimer timer(metrics.outputSeconds);
+
+    log() << std::endl << "Writing partial histograms..." << std::flush;
+
+    std::vector<std::uint64_t> row(static_cast<std::size_t>(width) * channels * 2 * buckets);
+
+    for (int j = 0; j < bandRows; j++)
+    {
+        std::size_t value = 0;
+
+        for (int i = 0; i < width; i++)
+        {
+            std::size_t idx = i + static_cast<std::size_t>(j) * width;
+
+            for (int channel = 0; channel < channels; channel++)
+            {
+                for (int bucket = 0; bucket < buckets; bucket++)
+                {
+                    row[value++] = bucketData.countA(idx, channel, bucket);
+                }
+
+                for (int bucket = 0; bucket < buckets; bucket++)
+                {
+                    row[value++] = bucketData.countB(idx, channel, bucket);
+                }
+            }
+        }
+
+        partialWriter->writeCounts(row.data(), row.size());
+
+        value = 0;
+
+        for (int i = 0; i < width; i++)
+        {
+            std::size_t idx = i + static_cast<std::size_t>(j) * width;
+
+            for (int channel = 0; channel < channels; channel++)
+            {
+                for (int bucket = 0; bucket < buckets; bucket++)
+                {
+                    row[value++] = bucketData.sums[bucketData.indexA(idx, channel) + bucket * bucketData.bucketStride];
+                }
+
+                for (int bucket = 0; bucket < buckets; bucket++)
+                {
+                    row[value++] = bucketData.sums[bucketData.indexB(idx, channel) + bucket * bucketData.bucketStride];
+                }
+            }
+        }
+
+        partialWriter->writeSums(row.data(), row.size());
+    }
+}
+
+// Add the rows of the band from every partial file to the counts and sums, in place of counting frames
+template <typename CountType, typename PixelType>
+void ImageProcessor<CountType, PixelType>::mergePartialBand()
+{
+    PhaseTimer timer(metrics.countSeconds);
+
+    log() << std::endl << "Merging:\t";
+
+    std::vector<std::uint64_t> row(static_cast<std::size_t>(width) * channels * 2 * buckets);
+
+    for (auto& reader : partialReaders)
+    {
+        log() << "|" << std::flush;
+
+        for (int j = 0; j < bandRows; j++)
+        {
+            reader->readCounts(row.data(), row.size());
+
+            std::size_t value = 0;
+
+            for (int i = 0; i < width; i++)
+            {
+                std::size_t idx = i + static_cast<std::size_t>(j) * width;
+
+                for (int channel = 0; channel < channels; channel++)
+                {
+                    for (int bucket = 0; bucket < buckets; bucket++)
+                    {
+                        bucketData.counts[bucketData.indexA(idx, channel) + bucket * bucketData.bucketStride] += static_cast<BucketType>(row[value++]);
+                    }
+
+                    for (int bucket = 0; bucket < buckets; bucket++)
+                    {
+                        bucketData.counts[bucketData.indexB(idx, channel) + bucket * bucketData.bucketStride] += static_cast<BucketType>(row[value++]);
+                    }
+                }
+            }
+
+            reader->readSums(row.data(), row.size());
+
+            // The sums are only kept when a pass is taken from them
+            if (bucketData.sums.empty())
+            {
+                continue;
+            }
+
+            value = 0;
+
+            for (int i = 0; i < width; i++)
+            {
+                std::size_t idx = i + static_cast<std::size_t>(j) * width;
+
+                for (int channel = 0; channel < channels; channel++)
+                {
+                    for (int bucket = 0; bucket < buckets; bucket++)
+                    {
+                        bucketData.sums[bucketData.indexA(idx, channel) + bucket * bucketData.bucketStride] += static_cast<SumType>(row[value++]);
+                    }
+
+                    for (int bucket = 0; bucket < buckets; bucket++)
+                    {
+                        bucketData.sums[bucketData.indexB(idx, channel) + bucket * bucketData.bucketStride] += static_cast<SumType>(row[value++]);
+                    }
+                }
+            }
+        }
+    }
+
+    log() << std::endl << "Finished merging partials...";
+}
+
+// Merge partial files written over parts of one sequence. The partials must count the same pixels into
+// the same buckets, their frames are added up. When the frames of the sequence were set before with
+// setFiles or setFrameSource, mode finding and both passes run over them as in a single run, and the
+// output is the same. Without frames, both passes are taken from the bucket sums.
+// Writing a partial file from a merge combines partials in several steps.
+template <typename CountType, typename PixelType>
+void ImageProcessor<CountType, PixelType>::mergePartials(const std::vector<std::string>& fns)
+{
+    if (!frameSource)
+    {
+        metrics = ProcessorMetrics();
+        runStart = std::chrono::steady_clock::now();
+        fileNames.clear();
+    }
+
+    partialReaders.clear();
+    streaming = false;
+
+    int partialFrames = 0;
+
+    for (const auto& fn : fns)
+    {
+        std::unique_ptr<PartialReader> reader(new PartialReader(fn));
+
+        if (!partialReaders.empty() && !partialsMatch(partialReaders[0]->header(), reader->header()))
+        {
+            throw ProcessingError("Partial file " + fn + " does not match " + fns[0] + "!");
+        }
+
+        partialFrames += static_cast<int>(reader->header().frames);
+        partialReaders.push_back(std::move(reader));
+    }
+
+    if (partialReaders.empty())
+    {
+        throw ProcessingError("No partial files to merge.");
+    }
+
+    const PartialHeader& header = partialReaders[0]->header();
+
+    if (static_cast<int>(header.depth) != depth || static_cast<int>(header.bucketSize) != bucketSize || static_cast<int>(header.buckets) != buckets)
+    {
+        throw ProcessingError("The partial files were counted with another bit depth or bucket size!");
+    }
+
+    if (frameSource)
+    {
+        if (static_cast<int>(header.width) != width || static_cast<int>(header.height) != height || static_cast<int>(header.channels) != channels || partialFrames != frames)
+        {
+            throw ProcessingError("The partial files count " + std::to_string(partialFrames) + " frames of " + std::to_string(header.width) + "x" + std::to_string(header.height)
+                + ", the sequence has " + std::to_string(frames) + " frames of " + std::to_string(width) + "x" + std::to_string(height) + "!");
+        }
+
+        log() << std::endl << "Merging " << partialReaders.size() << " partial files, the passes read the frames" << std::endl;
+    }
+    else
+    {
+        frames = partialFrames;
+        width = header.width;
+        height = header.height;
+        size = width * height;
+        channels = header.channels;
+
+        printImageData();
+    }
+
+    initializeData();
+    processSequence();
+
+    partialReaders.clear();
+}
+
+// Find the biggest bucket for each pixel
+template <typename CountType, typename PixelType>
+void ImageProcessor<CountType, PixelType>::findBiggestBucket()
+{
+    PhaseTimer timer(metrics.modeSeconds);
+
+    log() << std::endl << "Finding the biggest bucket..." << std::flush;
+
+    int pixelBytes = channels * static_cast<int>(2 * buckets * sizeof(BucketType) + sizeof(BucketEntry<BucketId>) + 2 * sizeof(BucketId)) + 1;
+    ModeTable<BucketId>& modes = bucketData.modes;
+
+    // Each row of a channel is handed to the vectorised kernel as one run of pixels
+    forEachTile(pixelBytes, [&](int firstRow, int lastRow)
+    {
+        for (int j = firstRow; j < lastRow; j++) 
+        {
+            std::size_t rowStart = static_cast<std::size_t>(j) * width;
+
+            for (int channel = 0; channel < channels; channel++) 
+            {
+                std::size_t planeStart = rowStart + channel * static_cast<std::size_t>(bandSize);
+                const BucketEntry<BucketId>* entries = &bucketData.finalBucket[planeStart];
+
+                findBiggestBuckets(bucketData, channel, buckets, rowStart, rowStart + width, &bucketData.finalBucket[planeStart]);
+
+                // The passes test the value range of the biggest bucket instead of classifying every value
+                for (int i = 0; i < width; i++)
+                {
+                    const std::vector<PixelType>& low = entries[i].isABucket ? classifier.lowA : classifier.lowB;
+                    const std::vector<PixelType>& high = entries[i].isABucket ? classifier.highA : classifier.highB;
+
+                    modes.low[planeStart + i] = low[entries[i].id];
+                    modes.high[planeStart + i] = high[entries[i].id];
+                }
+            }
+
+            // The second pass only tests the channel with the biggest count
+            for (int i = 0; i < width; i++)
+            {
+                int maxDiff = -1;
+                int maxChannel = 0;
+
+                for (int channel = 0; channel < channels; channel++)
+                {
+                    int diff = bucketData.finalBucket[rowStart + i + channel * static_cast<std::size_t>(bandSize)].diff;
+
+                    if (diff > maxDiff)
+                    {
+                        maxDiff = diff;
+                        maxChannel = channel;
+                    }
+                }
+
+                modes.keyChannel[rowStart + i] = static_cast<unsigned char>(maxChannel);
+            }
+        }
+    });
+}
+
+template <typename CountType, typename PixelType>
+void ImageProcessor<CountType, PixelType>::printPixelInformation(int x, int y) const
+{
+    log() << std::endl << "Pixel information for " << x << ", " << y << std::endl;
+
+    // Only the bucket data of the last band is kept
+    if (y < bandFirstRow || y >= bandFirstRow + bandRows)
+    {
+        log() << "\tNot available, the row was processed in an earlier band" << std::endl;
+        return;
+    }
+
+    int idx = x + (y - bandFirstRow) * width;
+
+    if (useClusters())
+    {
+        for (int cluster = 0; cluster < ClusterSketch<CountType, PixelType>::kClusters; cluster++)
+        {
+            log() << "\tCluster " << cluster << ": " << static_cast<int>(sketch.weight(idx, cluster)) << " frames, color";
+
+            for (int channel = 0; channel < channels; channel++)
+            {
+                log() << " " << static_cast<int>(sketch.color(idx, cluster, channel));
+            }
+
+            log() << std::endl;
+        }
+
+        return;
+    }
+
+    log() << std::endl << "\tA Buckets: ";
+    for (int bucket = 0; bucket < buckets; bucket++)
+    {
+        log() << static_cast<int>(bucketData.countA(idx, 0, bucket)) << " ";
+    }
+
+    log() << std::endl << "\tB Buckets: ";
+    for (int bucket = 0; bucket < buckets; bucket++)
+    {
+        log() << static_cast<int>(bucketData.countB(idx, 0, bucket)) << " ";
+    }
+
+    log() << std::endl;
+}
+
+template <typename CountType, typename PixelType>
+void ImageProcessor<CountType, PixelType>::firstPass(vec2d& acc, vec2d& total, std::vector<int>& count) const
+{
+    PhaseTimer timer(metrics.firstPassSeconds);
+
+    log() << std::endl << "1st pass:\t";
+
+    FramePipeline pipeline(bandFrames(), decoderThreads, lookahead);
+
+    // Bytes of frame and per-pixel state touched for every pixel of a tile
+    int pixelBytes = channels * static_cast<int>(sizeof(PixelType) + 2 * sizeof(float) + 2 * sizeof(BucketId)) + sizeof(int);
+    const ModeTable<BucketId>& modes = bucketData.modes;
+
+    for (int frame = 0; frame < frames; frame++)
+    {
+        const PixelType* newImage = reinterpret_cast<const PixelType*>(pipeline.next());
+
+        log() << "|" << std::flush;
+
+        forEachTile(pixelBytes, [&](int firstRow, int lastRow)
+        {
+            std::vector<unsigned char> hits(width);
+
+            for (int j = firstRow; j < lastRow; j++)
+            {
+                std::size_t rowStart = static_cast<std::size_t>(j) * width;
+
+                std::fill(hits.begin(), hits.end(), 0);
+
+                // Count the channels that fall into their biggest bucket, one channel plane at a time
+                for (int channel = 0; channel < channels; channel++)
+                {
+                    std::size_t planeStart = channel * static_cast<std::size_t>(bandSize) + rowStart;
+                    const PixelType* pixels = newImage + planeStart;
+                    float* totalRow = &total[channel][rowStart];
+
+                    for (int i = 0; i < width; i++)
+                    {
+                        totalRow[i] += pixels[i];
+                    }
+
+                    countModeHits(pixels, &modes.low[planeStart], &modes.high[planeStart], width, hits.data());
+                }
+
+                // Accumulate the pixels where every channel hit
+                for (int channel = 0; channel < channels; channel++)
+                {
+                    const PixelType* pixels = newImage + channel * bandSize + rowStart;
+                    float* accRow = &acc[channel][rowStart];
+
+                    for (int i = 0; i < width; i++)
+                    {
+                        if (hits[i] == channels)
+                        {
+                            accRow[i] += pixels[i];
+                        }
+                    }
+                }
+
+                int* countRow = &count[rowStart];
+
+                for (int i = 0; i < width; i++)
+                {
+                    countRow[i] += hits[i] == channels;
+                }
+            }
+        });
+    }
+
+    recordDecode(pipeline);
+}
+
+// The sums are as wide as the counters need, so every sequence the counters hold can keep them
+template <typename CountType, typename PixelType>
+bool ImageProcessor<CountType, PixelType>::useBucketSums() const
+{
+    bool keepSums = bucketSums || !partialFile.empty() || (!partialReaders.empty() && !frameSource);
+
+    return keepSums && !streaming && !useClusters();
+}
+
+// The cluster estimator replaces the histograms of whole sequences. Streams and windows
+// remove frames again, which the clusters cannot, so they always count into buckets, as do partials.
+template <typename CountType, typename PixelType>
+bool ImageProcessor<CountType, PixelType>::useClusters() const
+{
+    return estimator == Estimator::Clusters && !streaming && partialFile.empty() && partialReaders.empty();
+}
+
+// Take the first pass from the bucket sums. Every channel is averaged over its own biggest bucket
+// and a pixel counts the frames of the channel with the smallest one, so unlike the first pass over
+// the frames, the channels do not have to hit in the same frames. The sum of the A buckets of a pixel
+// is the sum of all its values. acc holds the average times the count, as the second pass and
+// drawImages expect.
+template <typename CountType, typename PixelType>
+void ImageProcessor<CountType, PixelType>::firstPassFromSums(vec2d& acc, vec2d& total, std::vector<int>& count) const
+{
+    PhaseTimer timer(metrics.firstPassSeconds);
+
+    int pixelBytes = channels * static_cast<int>(buckets * sizeof(SumType) + sizeof(BucketEntry<BucketId>) + 2 * sizeof(float)) + sizeof(int);
+
+    forEachTile(pixelBytes, [&](int firstRow, int lastRow)
+    {
+        for (int j = firstRow; j < lastRow; j++)
+        {
+            for (int i = 0; i < width; i++)
+            {
+                std::size_t idx = i + static_cast<std::size_t>(j) * width;
+                int minCount = frames;
+
+                for (int channel = 0; channel < channels; channel++)
+                {
+                    minCount = std::min(minCount, bucketData.finalBucket[idx + channel * static_cast<std::size_t>(bandSize)].diff);
+                }
+
+                count[idx] = minCount;
+
+                for (int channel = 0; channel < channels; channel++)
+                {
+                    const BucketEntry<BucketId>& entry = bucketData.finalBucket[idx + channel * static_cast<std::size_t>(bandSize)];
+                    std::size_t indexA = bucketData.indexA(idx, channel);
+                    double sum = bucketData.sums[bucketData.indexOf(idx, channel, entry)];
+                    double channelTotal = 0.0;
+
+                    for (int bucket = 0; bucket < buckets; bucket++)
+                    {
+                        channelTotal += bucketData.sums[indexA + bucket * bucketData.bucketStride];
+                    }
+
+                    acc[channel][idx] = entry.diff > 0 ? static_cast<float>(sum / entry.diff * minCount) : 0.0f;
+                    total[channel][idx] = static_cast<float>(channelTotal);
+                }
+            }
+        }
+    });
+}
+
+template <typename CountType, typename PixelType>
+void ImageProcessor<CountType, PixelType>::countFailed(vec2d& acc, std::vector<int>& count, std::vector<unsigned char>& cleared, int confFrames) const
+{
+    PhaseTimer timer(metrics.countFailedSeconds);
+
+    int pixelBytes = channels * static_cast<int>(sizeof(float)) + sizeof(int);
+
+    forEachTile(pixelBytes, [&](int firstRow, int lastRow)
+    {
+        for (int j = firstRow; j < lastRow; j++) 
+        {
+            for (int i = 0; i < width; i++) 
+            {
+                int idx = i + j * width;
+
+                if (count[idx] < confFrames) 
+                {
+                    count[idx] = 0;
+
+                    for (int channel = 0; channel < channels; channel++) 
+                    {
+                        acc[channel][idx] = 0.0f;
+                    }
+                }
+                else
+                {
+                    cleared[idx] = 1;
+                }
+            }
+        }
+    });
+}
+
+// Sum the pixels that failed the first pass over the frames where the channel with the biggest count
+// falls into its biggest bucket. Only the failed pixels are visited, and only the rows that hold them
+// are read, so the pass costs little when most pixels clear the first pass.
+template <typename CountType, typename PixelType>
+void ImageProcessor<CountType, PixelType>::secondPass(vec2d& acc, std::vector<int>& count, const std::vector<unsigned char>& cleared) const
+{
+    PhaseTimer timer(metrics.secondPassSeconds);
+
+    // Collect the failed pixels and the spans of rows they are on
+    std::vector<int> failed;
+    std::vector<RowSpan> spans;
+
+    for (int j = 0; j < bandRows; j++)
+    {
+        std::size_t before = failed.size();
+
+        for (int i = 0; i < width; i++)
+        {
+            int idx = i + j * width;
+
+            if (!cleared[idx])
+            {
+                failed.push_back(idx);
+            }
+        }
+
+        if (failed.size() == before)
+        {
+            continue;
+        }
+
+        if (!spans.empty() && spans.back().firstRow + spans.back().rows == bandFirstRow + j)
+        {
+            spans.back().rows++;
+        }
+        else
+        {
+            RowSpan span;
+            span.firstRow = bandFirstRow + j;
+            span.rows = 1;
+            spans.push_back(span);
+        }
+    }
+
+    int selectedRows = 0;
+
+    for (const auto& span : spans)
+    {
+        selectedRows += span.rows;
+    }
+
+    log() << std::endl << "2nd pass:\t" << failed.size() << " pixels in " << selectedRows << " rows ";
+
+    if (failed.empty())
+    {
+        return;
+    }
+
+    // Position of every failed pixel within the selected rows
+    std::vector<int> selected(failed.size());
+    std::unique_ptr<FrameSource> selection;
+
+    if (selectedRows < bandRows)
+    {
+        std::vector<int> selectedRow(bandRows, 0);
+        int row = 0;
+
+        for (const auto& span : spans)
+        {
+            for (int j = span.firstRow; j < span.firstRow + span.rows; j++)
+            {
+                selectedRow[j - bandFirstRow] = row++;
+            }
+        }
+
+        for (std::size_t k = 0; k < failed.size(); k++)
+        {
+            selected[k] = selectedRow[failed[k] / width] * width + failed[k] % width;
+        }
+
+        FrameRows frame;
+        frame.width = width;
+        frame.height = height;
+        frame.channels = channels;
+        frame.sampleBytes = sizeof(PixelType);
+        frame.rows = height;
+
+        selection.reset(new FrameRowSelection(*frameSource, frame, spans));
+    }
+    else
+    {
+        selected = failed;
+    }
+
+    FramePipeline pipeline(selection ? *selection : bandFrames(), decoderThreads, lookahead);
+
+    const ModeTable<BucketId>& modes = bucketData.modes;
+    std::size_t selectedPlane = static_cast<std::size_t>(selectedRows) * width;
+    int failedPixels = static_cast<int>(failed.size());
+
+    for (int frame = 0; frame < frames; frame++)
+    {
+        const PixelType* newImage = reinterpret_cast<const PixelType*>(pipeline.next());
+
+        log() << "|" << std::flush;
+
+        // Every failed pixel is visited once per frame, so the pixels never share their sums
+#pragma omp parallel for if (failedPixels > kParallelPixels)
+        for (int k = 0; k < failedPixels; k++)
+        {
+            int idx = failed[k];
+            int key = modes.keyChannel[idx];
+            std::size_t keyIdx = idx + key * static_cast<std::size_t>(bandSize);
+            PixelType value = newImage[selected[k] + key * selectedPlane];
+
+            if (value < modes.low[keyIdx] || value > modes.high[keyIdx])
+            {
+                continue;
+            }
+
+            for (int channel = 0; channel < channels; channel++) 
+            {
+                acc[channel][idx] += newImage[selected[k] + channel * selectedPlane];
+            }
+
+            count[idx]++;
+        }
+    }
+
+    recordDecode(pipeline);
+}
+
+// Take the second pass from the bucket sums when there are no frames to read, as in a merge of partials.
+// A failed pixel counts the frames in the biggest bucket of its channel with the biggest count, and
+// every channel is averaged over its own biggest bucket. The second pass over the frames averages
+// the channels over the frames where the key channel hits, so the two only differ where the
+// channels of the background do not change together.
+template <typename CountType, typename PixelType>
+void ImageProcessor<CountType, PixelType>::secondPassFromSums(vec2d& acc, std::vector<int>& count, const std::vector<unsigned char>& cleared) const
+{
+    PhaseTimer timer(metrics.secondPassSeconds);
+
+    int pixelBytes = channels * static_cast<int>(sizeof(std::uint32_t) + sizeof(BucketEntry<BucketId>) + sizeof(float)) + sizeof(int) + 2;
+    const ModeTable<BucketId>& modes = bucketData.modes;
+
+    forEachTile(pixelBytes, [&](int firstRow, int lastRow)
+    {
+        for (int j = firstRow; j < lastRow; j++)
+        {
+            for (int i = 0; i < width; i++)
+            {
+                std::size_t idx = i + static_cast<std::size_t>(j) * width;
+
+                if (cleared[idx])
+                {
+                    continue;
+                }
+
+                int keyCount = bucketData.finalBucket[idx + modes.keyChannel[idx] * static_cast<std::size_t>(bandSize)].diff;
+                count[idx] = keyCount;
+
+                for (int channel = 0; channel < channels; channel++)
+                {
+                    const BucketEntry<BucketId>& entry = bucketData.finalBucket[idx + channel * static_cast<std::size_t>(bandSize)];
+                    double sum = bucketData.sums[bucketData.indexOf(idx, channel, entry)];
+
+                    acc[channel][idx] = entry.diff > 0 ? static_cast<float>(sum / entry.diff * keyCount) : 0.0f;
+                }
+            }
+        }
+    });
+}
+
+// Paint the final result and the confidence mask of the current band into the output images of one level.
+// Pixels that reach the level in the first pass use its result, the others the result of the second pass.
+// Pixels cleared at the strictest level kept their first pass in acc and count, the first pass of the
+// others is only kept in firstAcc and firstCount when there are several levels.
+template <typename CountType, typename PixelType>
+void ImageProcessor<CountType, PixelType>::drawImages(OutputImages& output, const vec2d& firstAcc, const std::vector<int>& firstCount, const vec2d& acc, const vec2d& total, const std::vector<int>& count, const std::vector<unsigned char>& cleared)
+{
+    int confFrames = static_cast<int>(std::floor(output.confLevel * frames));
+    confFrames = std::max(confFrames, 1);
+
+    std::size_t bandOffset = static_cast<std::size_t>(bandFirstRow) * width;
+    std::vector<PixelType>& reconstruction = output.reconstruction;
+    std::vector<unsigned char>& confidence = output.confidence;
+    int outputChannels = std::min(channels, kOutputChannels);
+    int pixelBytes = channels * static_cast<int>(3 * sizeof(float)) + 2 * sizeof(int) + 1 + kOutputChannels * static_cast<int>(sizeof(PixelType) + 1);
+
+    // Every tile counts its failed pixels on its own and adds them to the totals once
+    forEachTile(pixelBytes, [&](int firstRow, int lastRow)
+    {
+        int tileFirstPassFail = 0;
+        int tileSecondPassFail = 0;
+
+        for (int j = firstRow; j < lastRow; j++) 
+        {
+            for (int i = 0; i < width; i++) 
+            {
+                int idx = i + j * width;
+                std::size_t out = bandOffset + idx;
+
+                const vec2d* pixelAcc = &acc;
+                int pixelCount = count[idx];
+
+                if (!cleared[idx])
+                {
+                    if (outputs.size() > 1 && firstCount[idx] >= confFrames)
+                    {
+                        pixelAcc = &firstAcc;
+                        pixelCount = firstCount[idx];
+                    }
+                    else
+                    {
+                        tileFirstPassFail++;
+                    }
+                }
+
+                reconstruction[out] = static_cast<PixelType>((*pixelAcc)[0][idx] / pixelCount);
+                reconstruction[out + size] = static_cast<PixelType>((*pixelAcc)[1][idx] / pixelCount);
+                reconstruction[out + 2 * size] = static_cast<PixelType>((*pixelAcc)[2][idx] / pixelCount);
+
+                int pixelConfidence = static_cast<int>(pixelCount * (256.0f / frames));
+                pixelConfidence = std::min(pixelConfidence, 255);
+
+                confidence[out] = static_cast<unsigned char>(pixelConfidence);
+                confidence[out + size] = static_cast<unsigned char>(pixelConfidence);
+                confidence[out + 2 * size] = static_cast<unsigned char>(pixelConfidence);
+
+                if (pixelCount < confFrames) 
+                {
+                    tileSecondPassFail++;
+
+                    confidence[out] = 255;
+                    confidence[out + size] /= 2;
+                    confidence[out + 2 * size] /= 2;
+
+                    for (int channel = 0; channel < outputChannels; channel++) 
+                    {
+                        float val = static_cast<float>(total[channel][idx]) / frames;
+                        reconstruction[out + channel * size] = static_cast<PixelType>(val);
+                    }
+                }
+            }
+        }
+
+#pragma omp atomic
+        output.firstPassFail += tileFirstPassFail;
+
+#pragma omp atomic
+        output.secondPassFail += tileSecondPassFail;
+    });
+}
+
+// Show the final result and the confidence mask until the windows are closed.
+// Clicking a pixel of the result prints its bucket counts.
+template <typename CountType, typename PixelType>
+void ImageProcessor<CountType, PixelType>::showImages() const
+{
+#if cimg_display
+    cimg_library::CImg<PixelType> reconstructionImage(outputs[0].reconstruction.data(), width, height, 1, kOutputChannels, true);
+    cimg_library::CImg<unsigned char> confidenceImage(outputs[0].confidence.data(), width, height, 1, kOutputChannels, true);
+
+    cimg_library::CImgDisplay mainDisp(reconstructionImage, "Reconstructed background");
+    cimg_library::CImgDisplay auxDisp(confidenceImage, "Confidence mask");
+
+    while (!mainDisp.is_closed()) 
+    {
+        mainDisp.wait();
+
+        if (mainDisp.button()) 
+        {
+            int x = mainDisp.mouse_x();
+            int y = mainDisp.mouse_y();
+
+            if (x >= 0 && x < width && y >= 0 && y < height) 
+            {
+                printPixelInformation(x, y);
+            }
+        }
+    }
+#else
+    log() << "Built without display support, see output.png and confidence.png." << std::endl;
+#endif
+}
+
+// Write the final color image and the confidence mask to file.
+// With several confidence levels the file names end in the level, e.g. output_0.5.png.
+template <typename CountType, typename PixelType>
+void ImageProcessor<CountType, PixelType>::saveImages() const
+{
+    if (outputs.size() == 1)
+    {
+        saveImage(outputs[0].reconstruction, "output.png");
+        saveImage(outputs[0].confidence, "confidence.png");
+        return;
+    }
+
+    std::vector<char> fn(64);
+
+    for (const auto& output : outputs)
+    {
+        std::snprintf(fn.data(), fn.size(), kSweepFileFormat, "output", output.confLevel);
+        saveImage(output.reconstruction, fn.data());
+
+        std::snprintf(fn.data(), fn.size(), kSweepFileFormat, "confidence", output.confLevel);
+        saveImage(output.confidence, fn.data());
+    }
+}
+
+// Write one of the output images to a PNG file, with 16 bits per sample for deep images
+template <typename CountType, typename PixelType>
+template <typename SampleType>
+void ImageProcessor<CountType, PixelType>::saveImage(const std::vector<SampleType>& image, const std::string& fn) const
+{
+    cimg_library::CImg<SampleType> outputImage(image.data(), width, height, 1, kOutputChannels, true);
+    std::string path = (std::filesystem::path(outputDirectory) / fn).string();
+
+    std::remove(path.c_str());
+    outputImage.save_png(path.c_str(), sizeof(SampleType));
+}
+
+// Create the final color image and confidence mask of every confidence level for the current band.
+// The passes themselves do not depend on the level, only which pixels take the second pass does.
+// The pixels that fail the strictest level take it once, and every level then picks the result
+// of either pass for each pixel.
+template <typename CountType, typename PixelType>
+void ImageProcessor<CountType, PixelType>::createFinal()
+{
+    float maxConfLevel = *std::max_element(confLevels.begin(), confLevels.end());
+    int confFrames = static_cast<int>(std::floor(maxConfLevel * frames));
+    confFrames = std::max(confFrames, 1);
+
+    passAcc.resize(channels);
+    passTotal.resize(channels);
+
+    for (int channel = 0; channel < channels; channel++) 
     {
-        mainDisp.wait();
+        passAcc[channel].assign(bandSize, 0.0f);
+        passTotal[channel].assign(bandSize, 0.0f);
+    }
 
-        if (mainDisp.button()) 
+    passCount.assign(bandSize, 0);
+    passCleared.assign(bandSize, 0);
+
+    if (useBucketSums())
+    {
+        firstPassFromSums(passAcc, passTotal, passCount);
+    }
+    else
+    {
+        firstPass(passAcc, passTotal, passCount);
+    }
+
+    // The second pass overwrites the failed pixels, so keep the first pass for the other levels
+    if (outputs.size() > 1)
+    {
+        passFirstAcc = passAcc;
+        passFirstCount = passCount;
+    }
+
+    countFailed(passAcc, passCount, passCleared, confFrames);
+
+    if (frameSource)
+    {
+        secondPass(passAcc, passCount, passCleared);
+    }
+    else
+    {
+        secondPassFromSums(passAcc, passCount, passCleared);
+    }
+
+    PhaseTimer timer(metrics.outputSeconds);
+
+    for (auto& output : outputs)
+    {
+        drawImages(output, passFirstAcc, passFirstCount, passAcc, passTotal, passCount, passCleared);
+    }
+}
+
+// Add every frame of the band to the clusters of its pixels, then draw the heaviest cluster
+// of every pixel. The frames are read once and there is no second pass.
+template <typename CountType, typename PixelType>
+void ImageProcessor<CountType, PixelType>::estimateClusters()
+{
+    {
+        PhaseTimer timer(metrics.countSeconds);
+
+        log() << std::endl << "Reading:\t";
+
+        FramePipeline pipeline(bandFrames(), decoderThreads, lookahead);
+
+        // A frame joins a cluster when it lies within a bucket size of its color
+        int radius = bucketSize;
+        int pixelBytes = static_cast<int>(channels * sizeof(PixelType) + ClusterSketch<CountType, PixelType>::pixelBytes(channels));
+
+        for (int frame = 0; frame < frames; frame++)
         {
-            int x = mainDisp.mouse_x();
-            int y = mainDisp.mouse_y();
+            const PixelType* newImage = reinterpret_cast<const PixelType*>(pipeline.next());
 
-            if (x >= 0 && x < width && y >= 0 && y < height) 
+            log() << "|" << std::flush;
+
+            forEachTile(pixelBytes, [&](int firstRow, int lastRow)
             {
-                printPixelInformation(x, y);
+                for (int j = firstRow; j < lastRow; j++)
+                {
+                    sketch.addRow(newImage, bandSize, static_cast<std::size_t>(j) * width, width, radius);
+                }
+            });
+        }
+
+        recordDecode(pipeline);
+
+        log() << std::endl << "Finished reading files...";
+    }
+
+    PhaseTimer timer(metrics.outputSeconds);
+
+    for (auto& output : outputs)
+    {
+        drawClusters(output);
+    }
+}
+
+// Paint the heaviest cluster of every pixel of the band. Pixels whose heaviest cluster matched fewer
+// frames than the confidence level keep its color and are marked in the confidence mask, there is no
+// second pass to fall back on. They count as failing both passes.
+template <typename CountType, typename PixelType>
+void ImageProcessor<CountType, PixelType>::drawClusters(OutputImages& output)
+{
+    int confFrames = static_cast<int>(std::floor(output.confLevel * frames));
+    confFrames = std::max(confFrames, 1);
+
+    std::size_t bandOffset = static_cast<std::size_t>(bandFirstRow) * width;
+    int outputChannels = std::min(channels, kOutputChannels);
+    int pixelBytes = static_cast<int>(ClusterSketch<CountType, PixelType>::pixelBytes(channels)) + kOutputChannels * static_cast<int>(sizeof(PixelType) + 1);
+
+    forEachTile(pixelBytes, [&](int firstRow, int lastRow)
+    {
+        int tileFail = 0;
+
+        for (int j = firstRow; j < lastRow; j++)
+        {
+            for (int i = 0; i < width; i++)
+            {
+                int idx = i + j * width;
+                std::size_t out = bandOffset + idx;
+
+                int cluster = sketch.heaviest(idx);
+                int pixelCount = sketch.weight(idx, cluster);
+
+                int pixelConfidence = static_cast<int>(pixelCount * (256.0f / frames));
+                pixelConfidence = std::min(pixelConfidence, 255);
+
+                for (int channel = 0; channel < outputChannels; channel++)
+                {
+                    output.reconstruction[out + channel * size] = sketch.color(idx, cluster, channel);
+                    output.confidence[out + channel * size] = static_cast<unsigned char>(pixelConfidence);
+                }
+
+                if (pixelCount < confFrames)
+                {
+                    tileFail++;
+
+                    output.confidence[out] = 255;
+                    output.confidence[out + size] /= 2;
+                    output.confidence[out + 2 * size] /= 2;
+                }
+            }
+        }
+
+#pragma omp atomic
+        output.firstPassFail += tileFail;
+
+#pragma omp atomic
+        output.secondPassFail += tileFail;
+    });
+}
+
+// Start a stream of frames with the given dimensions
+template <typename CountType, typename PixelType>
+void ImageProcessor<CountType, PixelType>::beginStream(int newWidth, int newHeight, int newChannels)
+{
+    streaming = true;
+    windowed = false;
+
+    frames = 0;
+    width = newWidth;
+    height = newHeight;
+    size = width * height;
+    channels = newChannels;
+
+    printImageData();
+    initializeData();
+}
+
+// Count a planar frame into the histograms and update the biggest buckets
+template <typename CountType, typename PixelType>
+void ImageProcessor<CountType, PixelType>::addFrame(const PixelType* frame)
+{
+    // The bucket sums are wide enough for any count, so only the counters and the frame count limit a stream
+    std::uint64_t frameLimit = std::min<std::uint64_t>(std::numeric_limits<BucketType>::max(), std::numeric_limits<int>::max());
+
+    if (static_cast<std::uint64_t>(frames) >= frameLimit)
+    {
+        if (windowed)
+        {
+            throw ProcessingError("The window does not fit the bucket counters after " + std::to_string(frames) + " frames!");
+        }
+
+        halveStream();
+    }
+
+    frames++;
+
+    int pixelBytes = channels * static_cast<int>(sizeof(PixelType) + 4 * (sizeof(BucketType) + sizeof(SumType)) + sizeof(BucketEntry<BucketId>) + sizeof(std::uint64_t));
+
+    forEachTile(pixelBytes, [&](int firstRow, int lastRow)
+    {
+        for (int channel = 0; channel < channels; channel++)
+        {
+            for (int j = firstRow; j < lastRow; j++)
+            {
+                for (int i = 0; i < width; i++)
+                {
+                    std::size_t idx = i + static_cast<std::size_t>(j) * width;
+                    std::size_t planeIdx = idx + channel * static_cast<std::size_t>(size);
+                    int value = frame[planeIdx];
+
+                    streamTotal[planeIdx] += value;
+
+                    int bucketA = classifier.bucketA[value];
+                    int bucketB = classifier.bucketB[value];
+                    std::size_t indexA = bucketData.indexA(idx, channel) + bucketA * bucketData.bucketStride;
+                    std::size_t indexB = bucketData.indexB(idx, channel) + bucketB * bucketData.bucketStride;
+
+                    int countA = ++bucketData.counts[indexA];
+                    int countB = ++bucketData.counts[indexB];
+                    bucketData.sums[indexA] += value;
+                    bucketData.sums[indexB] += value;
+
+                    // Only the two buckets of the value grew, so the biggest bucket is either one of them
+                    // or stays the same. Ties go to the earlier bucket in the order A0, B0, A1, B1, ...
+                    BucketEntry<BucketId>& entry = bucketData.finalBucket[planeIdx];
+                    int position = 2 * entry.id + (entry.isABucket ? 0 : 1);
+
+                    if (countA > entry.diff || (countA == entry.diff && 2 * bucketA < position))
+                    {
+                        entry.id = static_cast<BucketId>(bucketA);
+                        entry.isABucket = true;
+                        entry.diff = countA;
+                        position = 2 * bucketA;
+                    }
+
+                    if (countB > entry.diff || (countB == entry.diff && 2 * bucketB + 1 < position))
+                    {
+                        entry.id = static_cast<BucketId>(bucketB);
+                        entry.isABucket = false;
+                        entry.diff = countB;
+                    }
+                }
+            }
+        }
+    });
+}
+
+// Take a frame that was added before back out of the histograms, for a window of frames
+template <typename CountType, typename PixelType>
+void ImageProcessor<CountType, PixelType>::removeFrame(const PixelType* frame)
+{
+    frames--;
+
+    int pixelBytes = channels * static_cast<int>(sizeof(PixelType) + 4 * (sizeof(BucketType) + sizeof(SumType)) + sizeof(BucketEntry<BucketId>) + sizeof(std::uint64_t));
+
+    forEachTile(pixelBytes, [&](int firstRow, int lastRow)
+    {
+        for (int channel = 0; channel < channels; channel++)
+        {
+            for (int j = firstRow; j < lastRow; j++)
+            {
+                for (int i = 0; i < width; i++)
+                {
+                    std::size_t idx = i + static_cast<std::size_t>(j) * width;
+                    std::size_t planeIdx = idx + channel * static_cast<std::size_t>(size);
+                    int value = frame[planeIdx];
+
+                    streamTotal[planeIdx] -= value;
+
+                    int bucketA = classifier.bucketA[value];
+                    int bucketB = classifier.bucketB[value];
+                    std::size_t indexA = bucketData.indexA(idx, channel) + bucketA * bucketData.bucketStride;
+                    std::size_t indexB = bucketData.indexB(idx, channel) + bucketB * bucketData.bucketStride;
+
+                    bucketData.counts[indexA]--;
+                    bucketData.counts[indexB]--;
+                    bucketData.sums[indexA] -= value;
+                    bucketData.sums[indexB] -= value;
+
+                    // The other buckets only shrink if the biggest one did, so only then can it change
+                    const BucketEntry<BucketId>& entry = bucketData.finalBucket[planeIdx];
+
+                    if (entry.id == (entry.isABucket ? bucketA : bucketB))
+                    {
+                        rescanBiggestBucket(idx, channel);
+                    }
+                }
+            }
+        }
+    });
+}
+
+// Find the biggest bucket of one pixel and channel again, in the order A0, B0, A1, B1, ...
+template <typename CountType, typename PixelType>
+void ImageProcessor<CountType, PixelType>::rescanBiggestBucket(std::size_t idx, int channel)
+{
+    BucketEntry<BucketId>& entry = bucketData.finalBucket[idx + channel * static_cast<std::size_t>(size)];
+
+    entry.id = 0;
+    entry.isABucket = true;
+    entry.diff = bucketData.countA(idx, channel, 0);
+
+    for (int bucket = 0; bucket < buckets; bucket++)
+    {
+        int countA = bucketData.countA(idx, channel, bucket);
+        int countB = bucketData.countB(idx, channel, bucket);
+
+        if (countA > entry.diff)
+        {
+            entry.id = static_cast<BucketId>(bucket);
+            entry.isABucket = true;
+            entry.diff = countA;
+        }
+
+        if (countB > entry.diff)
+        {
+            entry.id = static_cast<BucketId>(bucket);
+            entry.isABucket = false;
+            entry.diff = countB;
+        }
+    }
+}
+
+// Halve the counts, sums and totals of a stream whose counters are full, so a watcher keeps running.
+// The frames added so far then weigh half as much as the frames added after them.
+template <typename CountType, typename PixelType>
+void ImageProcessor<CountType, PixelType>::halveStream()
+{
+    log() << std::endl << "Bucket counters full after " << frames << " frames, halving the counts of the earlier frames." << std::endl;
+
+    for (auto& count : bucketData.counts)
+    {
+        count /= 2;
+    }
+
+    for (auto& sum : bucketData.sums)
+    {
+        sum /= 2;
+    }
+
+    for (auto& total : streamTotal)
+    {
+        total /= 2;
+    }
+
+    frames /= 2;
+
+    for (int channel = 0; channel < channels; channel++)
+    {
+        for (int idx = 0; idx < size; idx++)
+        {
+            rescanBiggestBucket(idx, channel);
+        }
+    }
+}
+
+// Slide a window over the sequence. Every frame is added to the histograms as it enters
+// the window and removed again as it leaves, so each background costs one bucket update
+// per frame instead of a run over the whole window.
+template <typename CountType, typename PixelType>
+void ImageProcessor<CountType, PixelType>::processWindow(int windowFrames)
+{
+    int sequenceFrames = frames;
+
+    streaming = true;
+    windowed = true;
+    frames = 0;
+    initializeData();
+
+    log() << std::endl << "Window of " << windowFrames << " frames:\t";
+
+    FramePipeline pipeline(*frameSource, decoderThreads, lookahead);
+    std::vector<unsigned char> leavingBuffer;
+    std::vector<char> fn(64);
+
+    for (int frame = 0; frame < sequenceFrames; frame++)
+    {
+        {
+            PhaseTimer timer(metrics.countSeconds);
+
+            // The frame leaving the window was read before, so it comes from the frame cache. It is taken
+            // out first, so the counters never hold more than the frames of the window.
+            if (frame >= windowFrames)
+            {
+                removeFrame(reinterpret_cast<const PixelType*>(frameSource->readFrame(frame - windowFrames, leavingBuffer)));
             }
+
+            addFrame(reinterpret_cast<const PixelType*>(pipeline.next()));
+        }
+
+        {
+            PhaseTimer timer(metrics.outputSeconds);
+
+            currentBackground();
+
+            std::snprintf(fn.data(), fn.size(), kWindowFileFormat, frame);
+            saveImage(outputs[0].reconstruction, fn.data());
         }
+
+        log() << "|" << std::flush;
+    }
+
+    recordDecode(pipeline);
+
+    finishMetrics(sequenceFrames);
+
+    log() << std::endl << "Wrote " << sequenceFrames << " background frames" << std::endl << std::endl;
+    printMetrics(log(), metrics);
+}
+
+// Add an image file to the stream. The first file starts the stream and sets its dimensions,
+// later files that do not match them are skipped.
+template <typename CountType, typename PixelType>
+void ImageProcessor<CountType, PixelType>::addFile(const std::string& fn)
+{
+    cimg_library::CImg<PixelType> newImage(fn.c_str());
+
+    if (!streaming)
+    {
+        beginStream(newImage.width(), newImage.height(), newImage.spectrum());
+    }
+
+    if (newImage.width() != width || newImage.height() != height || newImage.spectrum() != channels)
+    {
+        std::cerr << "Frame " << fn << " does not match the sequence dimensions. Skipping." << std::endl;
+        return;
     }
+
+    addFrame(newImage.data());
 }
 
-// Create final color image and a confidence mask, then display them
-void ImageProcessor::createFinal() const
+// Build the background of the frames added so far from the biggest buckets.
+// The passes over the frames are replaced by the bucket sums: every channel is averaged over
+// its own biggest bucket. A pixel clears the first pass when every channel reaches the confidence
+// level, and the second pass when the channel with the biggest bucket does.
+template <typename CountType, typename PixelType>
+const std::vector<PixelType>& ImageProcessor<CountType, PixelType>::currentBackground()
 {
-    int firstPassFail = 0;
-    int secondPassFail = 0;
+    OutputImages& output = outputs[0];
+    std::vector<PixelType>& reconstruction = output.reconstruction;
+    std::vector<unsigned char>& confidence = output.confidence;
+
+    output.firstPassFail = 0;
+    output.secondPassFail = 0;
+
+    if (frames == 0)
+    {
+        return reconstruction;
+    }
 
-    int confFrames = static_cast<int>(std::floorf(confLevel * frames));
+    int confFrames = static_cast<int>(std::floor(output.confLevel * frames));
     confFrames = std::max(confFrames, 1);
 
-    std::vector<std::vector<float>> acc;
-    std::vector<std::vector<float>> total;
+    int outputChannels = std::min(channels, kOutputChannels);
+    int pixelBytes = channels * static_cast<int>(sizeof(BucketEntry<BucketId>) + sizeof(SumType) + sizeof(std::uint64_t) + 2);
 
-    for (int channel = 0; channel < channels; channel++) 
+    forEachTile(pixelBytes, [&](int firstRow, int lastRow)
+    {
+        int tileFirstPassFail = 0;
+        int tileSecondPassFail = 0;
+
+        for (int j = firstRow; j < lastRow; j++)
+        {
+            for (int i = 0; i < width; i++)
+            {
+                std::size_t idx = i + static_cast<std::size_t>(j) * width;
+
+                int minCount = frames;
+                int maxCount = 0;
+
+                for (int channel = 0; channel < channels; channel++)
+                {
+                    int count = bucketData.finalBucket[idx + channel * size].diff;
+                    minCount = std::min(minCount, count);
+                    maxCount = std::max(maxCount, count);
+                }
+
+                int count = minCount;
+
+                if (minCount < confFrames)
+                {
+                    tileFirstPassFail++;
+                    count = maxCount;
+                }
+
+                int pixelConfidence = std::min(static_cast<int>(count * (256.0f / frames)), 255);
+
+                for (int channel = 0; channel < kOutputChannels; channel++)
+                {
+                    confidence[idx + channel * size] = static_cast<unsigned char>(pixelConfidence);
+                }
+
+                if (count < confFrames)
+                {
+                    tileSecondPassFail++;
+
+                    confidence[idx] = 255;
+                    confidence[idx + size] /= 2;
+                    confidence[idx + 2 * size] /= 2;
+
+                    for (int channel = 0; channel < outputChannels; channel++)
+                    {
+                        reconstruction[idx + channel * size] = static_cast<PixelType>(static_cast<float>(streamTotal[idx + channel * size]) / frames);
+                    }
+
+                    continue;
+                }
+
+                for (int channel = 0; channel < outputChannels; channel++)
+                {
+                    const BucketEntry<BucketId>& entry = bucketData.finalBucket[idx + channel * size];
+                    float sum = static_cast<float>(bucketData.sums[bucketData.indexOf(idx, channel, entry)]);
+
+                    reconstruction[idx + channel * size] = static_cast<PixelType>(sum / entry.diff);
+                }
+            }
+        }
+
+#pragma omp atomic
+        output.firstPassFail += tileFirstPassFail;
+
+#pragma omp atomic
+        output.secondPassFail += tileSecondPassFail;
+    });
+
+    return reconstruction;
+}
+
+// Add the decode times of a pass to the metrics
+template <typename CountType, typename PixelType>
+void ImageProcessor<CountType, PixelType>::recordDecode(const FramePipeline& pipeline) const
+{
+    metrics.decodeSeconds += pipeline.decodeSeconds();
+    metrics.decodeWaitSeconds += pipeline.waitSeconds();
+}
+
+// Fill in the sequence data and totals of the metrics at the end of a run,
+// and write them to the metrics file if there is one
+template <typename CountType, typename PixelType>
+void ImageProcessor<CountType, PixelType>::finishMetrics(int processedFrames)
+{
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - runStart;
+
+    metrics.frames = processedFrames;
+    metrics.width = width;
+    metrics.height = height;
+    metrics.channels = channels;
+    metrics.depth = depth;
+    metrics.counterBits = 8 * sizeof(BucketType);
+    metrics.totalSeconds = elapsed.count();
+    metrics.peakResidentBytes = peakResidentBytes();
+
+    if (!metricsFile.empty() && !writeMetricsJson(metricsFile, metrics))
     {
-        std::vector<float> tempAcc(size);
-        acc.push_back(tempAcc);
+        std::cerr << "Could not write metrics file " << metricsFile << "!" << std::endl;
+    }
+}
+
+// Return the phase times and memory use of the last run
+template <typename CountType, typename PixelType>
+const ProcessorMetrics& ImageProcessor<CountType, PixelType>::processingMetrics() const
+{
+    return metrics;
+}
 
-        std::vector<float> tempTotal(size);
-        total.push_back(tempTotal);
+// Return the background of the last run
+template <typename CountType, typename PixelType>
+const std::vector<PixelType>& ImageProcessor<CountType, PixelType>::background() const
+{
+    return outputs[0].reconstruction;
+}
+
+// Pick the bucket counter width from the number of frames
+int processorCounterBits(int frames)
+{
+    if (frames <= std::numeric_limits<std::uint8_t>::max())
+    {
+        return 8;
     }
 
-    std::vector<int> count(size);
-    std::vector<bool> cleared(size);
+    if (frames <= std::numeric_limits<std::uint16_t>::max())
+    {
+        return 16;
+    }
 
-    firstPass(acc, total, count);
-    countFailed(acc, count, cleared, confFrames, firstPassFail);
-    secondPass(acc, count, cleared);
-    drawImages(acc, total, count, confFrames, firstPassFail, secondPassFail);
+    return 32;
 }
+
+template class ImageProcessor<std::uint8_t, std::uint8_t>;
+template class ImageProcessor<std::uint16_t, std::uint8_t>;
+template class ImageProcessor<std::uint32_t, std::uint8_t>;
+template class ImageProcessor<std::uint8_t, std::uint16_t>;
+template class ImageProcessor<std::uint16_t, std::uint16_t>;
+template class ImageProcessor<std::uint32_t, std::uint16_t>;
@@ -3,11 +3,48 @@
 
 #pragma once
 
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <ostream>
 #include <string>
 #include <vector>
 
 #include "bucket_data.h"
+#include "bucket_kernels.h"
+#include "cluster_sketch.h"
+#include "frame_source.h"
+#include "partial_state.h"
+#include "processor_metrics.h"
 
+class FramePipeline;
+
+// Processor options that are shared by every sequence of a run
+struct ProcessorSettings {
+    int depth = 8;
+    int bucketSize = 8;
+    std::vector<float> confLevels = {0.2f};
+    int samples = 0;
+    std::size_t memoryBudget = std::size_t(4096) << 20;
+    int decoderThreads = 1;
+    int lookahead = 8;
+    BucketLayout layout = BucketLayout::PixelMajor;
+    bool bucketSums = false;
+    Estimator estimator = Estimator::Buckets;
+    std::size_t maxMemory = 0;
+    int window = 0;
+    bool headless = false;
+    std::string frameStack;
+    std::string metricsFile;
+    std::string partialFile;
+    bool compressPartial = true;
+};
+
+// CountType is the type of the bucket counters. It has to hold the number of frames,
+// see processorCounterBits() for picking the smallest one.
+// PixelType is the type of the input samples, 8-bit or 16-bit for deeper images.
+template <typename CountType, typename PixelType = std::uint8_t>
 class ImageProcessor {
 public:
     ImageProcessor();
@@ -15,33 +52,145 @@ public:
 
     void setFiles(const std::vector<std::string>& fn);
     void setBucketSize(int newSize);
+    void setBitDepth(int newDepth);
     void setConfidenceLevel(float newConf);
+    void setConfidenceLevels(const std::vector<float>& newConfs);
+    void setSampleCount(int newSamples);
+    void setMemoryBudget(std::size_t bytes);
+    void setDecoderThreads(int threads, int frameLookahead);
+    void setBucketLayout(BucketLayout newLayout);
+    void setBucketSums(bool newBucketSums);
+    void setEstimator(Estimator newEstimator);
+    void setMaxMemory(std::size_t bytes);
+    void setHeadless(bool newHeadless);
+    void setFrameStack(const std::string& fn);
+    void setMetricsFile(const std::string& fn);
+    void setPartialFile(const std::string& fn, bool compress);
+    void setQuiet(bool newQuiet);
+    void setOutputDirectory(const std::string& directory);
+    void setSettings(const ProcessorSettings& settings);
+    void setFrameSource(std::unique_ptr<FrameSource> source, int newWidth, int newHeight, int newChannels);
     void processSequence();
 
+    // Add up the partial histograms written by several runs over parts of one sequence and create the final output.
+    // The passes read the frames set with setFiles or setFrameSource, if any.
+    void mergePartials(const std::vector<std::string>& fns);
+
+    // Pipeline stages, public so that they can be run and timed in isolation
+    void countBuckets();
+    void findBiggestBucket();
+    void createFinal();
+
+    // Single pass of the cluster estimator over the frames of the band, in place of the three stages above
+    void estimateClusters();
+
+    // Phase times and memory use of the last run
+    const ProcessorMetrics& processingMetrics() const;
+
+    // Reconstructed background of the first confidence level, planar RGB
+    const std::vector<PixelType>& background() const;
+
+    // Incremental processing of a stream of frames, such as a fixed camera adding frames over time.
+    // Every frame updates the histograms and the biggest buckets in place, so a fresh
+    // background costs one pass over the pixels instead of a run over the whole sequence.
+    void beginStream(int newWidth, int newHeight, int newChannels);
+    void addFrame(const PixelType* frame);
+    void removeFrame(const PixelType* frame);
+    void addFile(const std::string& fn);
+    const std::vector<PixelType>& currentBackground();
+    void saveImages() const;
+
+    // Write a background for every frame of the sequence, computed over the last windowFrames frames
+    void processWindow(int windowFrames);
+
 private:
     using vec2d = std::vector<std::vector<float>>;
-    using BucketType = unsigned char;
+    using BucketType = CountType;
+    using BucketId = PixelType;
+    using SumType = typename BucketData<BucketType, BucketId>::SumType;
 
-    std::vector<BucketData<BucketType>> bucketData;
+    BucketData<BucketType, BucketId> bucketData;
+    BucketClassifier<PixelType> classifier;
+    ClusterSketch<CountType, PixelType> sketch;
     std::vector<std::string> fileNames;
+    std::unique_ptr<FrameSource> frameSource;
+    std::unique_ptr<FrameSource> bandSource;
+
+    // Partial histograms being written, or being merged in place of counting frames
+    std::unique_ptr<PartialWriter> partialWriter;
+    std::vector<std::unique_ptr<PartialReader>> partialReaders;
+
+    // Output images of one confidence level for the whole frame, planar RGB. The background keeps the input depth.
+    struct OutputImages {
+        float confLevel = 0.0f;
+        std::vector<PixelType> reconstruction;
+        std::vector<unsigned char> confidence;
+        int firstPassFail = 0;
+        int secondPassFail = 0;
+    };
+
+    // One output per confidence level, the streaming modes and the viewer use the first one
+    std::vector<OutputImages> outputs;
+
+    // State of the two passes over the frames, kept between bands and sequences to reuse the buffers
+    vec2d passAcc;
+    vec2d passTotal;
+    std::vector<int> passCount;
+
+    // One byte per pixel instead of packed bits, so that tiles never share a word of the flags
+    std::vector<unsigned char> passCleared;
+    vec2d passFirstAcc;
+    std::vector<int> passFirstCount;
+
+    // Sum of every pixel value of the stream, planar by channel
+    std::vector<std::uint64_t> streamTotal;
+    bool streaming = false;
+
+    // A window removes the frames it added, so its counts must never be halved
+    bool windowed = false;
 
     int getABucket(int value) const;
     int getBBucket(int value) const;
 
     void inferParameters();
+    std::unique_ptr<FrameSource> openFrameStack(std::unique_ptr<FrameSource> files);
+    void rejectBadFrames();
     void initializeData();
 
+    std::size_t frameCacheBudget() const;
+    int planBandRows() const;
+    void setBand(int firstRow, int rows);
+    FrameSource& bandFrames() const;
+
+    template <typename Kernel>
+    void forEachTile(int pixelBytes, Kernel kernel) const;
+
+    std::ostream& log() const;
+
+    void recordDecode(const FramePipeline& pipeline) const;
+    void finishMetrics(int processedFrames);
+
     void printPixelInformation(int x, int y) const;
     void printImageData() const;
 
-    void countBuckets();
-    void findBiggestBucket();
-    void createFinal() const;
-
+    bool useBucketSums() const;
+    bool useClusters() const;
     void firstPass(vec2d& acc, vec2d& total, std::vector<int>& count) const;
-    void countFailed(vec2d& acc, std::vector<int>& count, std::vector<bool>& cleared, int confFrames, int& failed) const;
-    void secondPass(vec2d& acc, std::vector<int>& count, std::vector<bool>& cleared) const;
-    void drawImages(vec2d& acc, vec2d& total, std::vector<int> count, int confFrames, int& firstPassFail, int& secondPassFail) const;
+    void firstPassFromSums(vec2d& acc, vec2d& total, std::vector<int>& count) const;
+    void countFailed(vec2d& acc, std::vector<int>& count, std::vector<unsigned char>& cleared, int confFrames) const;
+    void secondPass(vec2d& acc, std::vector<int>& count, const std::vector<unsigned char>& cleared) const;
+    void secondPassFromSums(vec2d& acc, std::vector<int>& count, const std::vector<unsigned char>& cleared) const;
+    void drawImages(OutputImages& output, const vec2d& firstAcc, const std::vector<int>& firstCount, const vec2d& acc, const vec2d& total, const std::vector<int>& count, const std::vector<unsigned char>& cleared);
+    void drawClusters(OutputImages& output);
+    void showImages() const;
+    void rescanBiggestBucket(std::size_t idx, int channel);
+    void halveStream();
+
+    void writePartialBand();
+    void mergePartialBand();
+
+    template <typename SampleType>
+    void saveImage(const std::vector<SampleType>& image, const std::string& fn) const;
 
     int frames = 0;
     int width = 0;
@@ -50,10 +199,39 @@ private:
     int channels = 0;
     int depth = 0;
 
+    // Rows of the image currently being processed, the whole image unless memory is limited
+    int bandFirstRow = 0;
+    int bandRows = 0;
+    int bandSize = 0;
+
     int minVal = 0;
     int maxVal = 0;
     int bucketSize = 0;
     int buckets = 0;
 
-    float confLevel = 0.0f;
-};
\ No newline at end of file
+    std::vector<float> confLevels;
+    int sampleCount = 0;
+    std::size_t memoryBudget = 0;
+    int decoderThreads = 0;
+    int lookahead = 0;
+    BucketLayout layout = BucketLayout::BucketMajor;
+    bool bucketSums = false;
+    Estimator estimator = Estimator::Buckets;
+    std::size_t maxMemory = 0;
+    bool headless = false;
+    bool quiet = false;
+    std::string outputDirectory;
+    std::string frameStackFile;
+    std::string metricsFile;
+    std::string partialFile;
+    bool compressPartial = true;
+    mutable std::ostream silent;
+
+    // Updated by the const passes as well
+    mutable ProcessorMetrics metrics;
+    std::chrono::steady_clock::time_point runStart;
+};
+
+// Number of bits in the smallest bucket counter that can count every frame of a sequence
+int processorCounterBits(int frames);
+
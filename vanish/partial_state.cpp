@@ -0,0 +1,308 @@
+// PartialState
+// Bucket histograms of part of a sequence, written by one process and merged by another
+#include "partial_state.h"
+#include "processing_error.h"
+
+#include <cstring>
+
+namespace
+{
+    const char kPartialMagic[8] = "VNPART";
+    const std::uint32_t kPartialVersion = 2;
+    const std::size_t kBufferBytes = 1 << 16;
+    const std::string kTempSuffix = ".tmp";
+
+    // Fewest bytes that hold every value up to the given one
+    std::uint32_t valueBytes(std::uint64_t maxValue)
+    {
+        std::uint32_t bytes = 1;
+
+        while (bytes < sizeof(std::uint64_t) && (maxValue >> (8 * bytes)) != 0)
+        {
+            bytes++;
+        }
+
+        return bytes;
+    }
+}
+
+PartialHeader partialHeader(int width, int height, int channels, int depth, int bucketSize, int buckets, int frames, bool compressed)
+{
+    PartialHeader header;
+
+    std::memcpy(header.magic, kPartialMagic, sizeof(header.magic));
+    header.version = kPartialVersion;
+    header.width = width;
+    header.height = height;
+    header.channels = channels;
+    header.depth = depth;
+    header.bucketSize = bucketSize;
+    header.buckets = buckets;
+    header.frames = frames;
+    header.counterBytes = valueBytes(static_cast<std::uint64_t>(frames));
+    header.sumBytes = valueBytes(static_cast<std::uint64_t>(frames) * ((std::uint64_t(1) << depth) - 1));
+    header.compressed = compressed ? 1 : 0;
+
+    return header;
+}
+
+bool readPartialHeader(const std::string& fn, PartialHeader& header)
+{
+    std::FILE* file = std::fopen(fn.c_str(), "rb");
+
+    if (!file)
+    {
+        return false;
+    }
+
+    bool valid = std::fread(&header, sizeof(header), 1, file) == 1
+        && std::memcmp(header.magic, kPartialMagic, sizeof(header.magic)) == 0
+        && header.version == kPartialVersion
+        && header.counterBytes >= 1 && header.counterBytes <= sizeof(std::uint64_t)
+        && header.sumBytes >= 1 && header.sumBytes <= sizeof(std::uint64_t);
+
+    std::fclose(file);
+
+    return valid;
+}
+
+bool partialsMatch(const PartialHeader& first, const PartialHeader& second)
+{
+    return first.width == second.width && first.height == second.height && first.channels == second.channels
+        && first.depth == second.depth && first.bucketSize == second.bucketSize && first.buckets == second.buckets;
+}
+
+PartialWriter::PartialWriter(const std::string& fn, const PartialHeader& header)
+    : fileName(fn)
+    , tempName(fn + kTempSuffix)
+    , partial(header)
+{
+    file = std::fopen(tempName.c_str(), "wb");
+
+    if (!file)
+    {
+        throw ProcessingError("Could not create partial file " + fn + "!");
+    }
+
+    buffer.reserve(kBufferBytes);
+
+    const unsigned char* headerBytes = reinterpret_cast<const unsigned char*>(&header);
+    buffer.assign(headerBytes, headerBytes + sizeof(header));
+}
+
+// A writer that was never closed leaves only the temporary file behind
+PartialWriter::~PartialWriter()
+{
+    if (file)
+    {
+        std::fclose(file);
+    }
+}
+
+void PartialWriter::writeCounts(const std::uint64_t* values, std::size_t count)
+{
+    write(values, count, partial.counterBytes);
+}
+
+void PartialWriter::writeSums(const std::uint64_t* values, std::size_t count)
+{
+    write(values, count, partial.sumBytes);
+}
+
+void PartialWriter::write(const std::uint64_t* values, std::size_t count, int bytes)
+{
+    if (!partial.compressed)
+    {
+        for (std::size_t i = 0; i < count; i++)
+        {
+            for (int byte = 0; byte < bytes; byte++)
+            {
+                putByte(static_cast<unsigned char>(values[i] >> (8 * byte)));
+            }
+        }
+
+        return;
+    }
+
+    // A run of zeros is a zero byte and the length of the run. The variable-length integer
+    // of a value above zero never starts with a zero byte.
+    for (std::size_t i = 0; i < count; i++)
+    {
+        if (values[i] == 0)
+        {
+            zeroRun++;
+            continue;
+        }
+
+        flushZeros();
+        putVarint(values[i]);
+    }
+}
+
+void PartialWriter::close()
+{
+    flushZeros();
+    flushBuffer();
+
+    bool failed = std::fclose(file) != 0;
+    file = nullptr;
+
+    std::remove(fileName.c_str());
+
+    if (failed || std::rename(tempName.c_str(), fileName.c_str()) != 0)
+    {
+        throw ProcessingError("Failed to write partial file " + fileName + "!");
+    }
+}
+
+void PartialWriter::putByte(unsigned char byte)
+{
+    buffer.push_back(byte);
+
+    if (buffer.size() >= kBufferBytes)
+    {
+        flushBuffer();
+    }
+}
+
+// Seven bits per byte, low bits first, the top bit set on every byte but the last
+void PartialWriter::putVarint(std::uint64_t value)
+{
+    while (value >= 0x80)
+    {
+        putByte(static_cast<unsigned char>(value | 0x80));
+        value >>= 7;
+    }
+
+    putByte(static_cast<unsigned char>(value));
+}
+
+void PartialWriter::flushZeros()
+{
+    if (zeroRun > 0)
+    {
+        putByte(0);
+        putVarint(zeroRun);
+        zeroRun = 0;
+    }
+}
+
+void PartialWriter::flushBuffer()
+{
+    if (!buffer.empty() && std::fwrite(buffer.data(), 1, buffer.size(), file) != buffer.size())
+    {
+        throw ProcessingError("Failed to write partial file " + fileName + "!");
+    }
+
+    buffer.clear();
+}
+
+PartialReader::PartialReader(const std::string& fn)
+    : fileName(fn)
+{
+    if (!readPartialHeader(fn, partial))
+    {
+        throw ProcessingError("Could not read partial file " + fn + "!");
+    }
+
+    file = std::fopen(fn.c_str(), "rb");
+
+    if (!file || std::fseek(file, sizeof(partial), SEEK_SET) != 0)
+    {
+        throw ProcessingError("Could not read partial file " + fn + "!");
+    }
+}
+
+PartialReader::~PartialReader()
+{
+    if (file)
+    {
+        std::fclose(file);
+    }
+}
+
+const PartialHeader& PartialReader::header() const
+{
+    return partial;
+}
+
+void PartialReader::readCounts(std::uint64_t* values, std::size_t count)
+{
+    read(values, count, partial.counterBytes);
+}
+
+void PartialReader::readSums(std::uint64_t* values, std::size_t count)
+{
+    read(values, count, partial.sumBytes);
+}
+
+void PartialReader::read(std::uint64_t* values, std::size_t count, int bytes)
+{
+    if (!partial.compressed)
+    {
+        for (std::size_t i = 0; i < count; i++)
+        {
+            values[i] = 0;
+
+            for (int byte = 0; byte < bytes; byte++)
+            {
+                values[i] |= static_cast<std::uint64_t>(getByte()) << (8 * byte);
+            }
+        }
+
+        return;
+    }
+
+    for (std::size_t i = 0; i < count; i++)
+    {
+        if (zeroRun == 0)
+        {
+            std::uint64_t value = getVarint();
+
+            if (value != 0)
+            {
+                values[i] = value;
+                continue;
+            }
+
+            zeroRun = getVarint();
+        }
+
+        values[i] = 0;
+        zeroRun--;
+    }
+}
+
+unsigned char PartialReader::getByte()
+{
+    if (bufferPos == buffer.size())
+    {
+        buffer.resize(kBufferBytes);
+        buffer.resize(std::fread(buffer.data(), 1, kBufferBytes, file));
+        bufferPos = 0;
+
+        if (buffer.empty())
+        {
+            throw ProcessingError("Partial file " + fileName + " is truncated!");
+        }
+    }
+
+    return buffer[bufferPos++];
+}
+
+// A zero byte stands on its own, it starts a run of zeros
+std::uint64_t PartialReader::getVarint()
+{
+    std::uint64_t value = 0;
+    int shift = 0;
+    unsigned char byte = 0;
+
+    do
+    {
+        byte = getByte();
+        value |= static_cast<std::uint64_t>(byte & 0x7f) << shift;
+        shift += 7;
+    } while ((byte & 0x80) != 0 && shift < 64);
+
+    return value;
+}
@@ -0,0 +1,98 @@
+// PartialState
+// Bucket histograms of part of a sequence, written by one process and merged by another
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+// A partial file starts with the header, followed by every row of the image in turn.
+// A row holds the counters of its pixels, pixel by pixel, with the A then the B histogram
+// of every channel, and then the bucket sums in the same order. The header is in the native
+// byte order. Uncompressed values are little-endian, counterBytes wide for the counters and
+// sumBytes wide for the sums, the fewest bytes that hold the frames and their largest sum.
+struct PartialHeader {
+    char magic[8] = {};
+    std::uint32_t version = 0;
+    std::uint32_t width = 0;
+    std::uint32_t height = 0;
+    std::uint32_t channels = 0;
+    std::uint32_t depth = 0;
+    std::uint32_t bucketSize = 0;
+    std::uint32_t buckets = 0;
+    std::uint32_t frames = 0;
+    std::uint32_t counterBytes = 0;
+    std::uint32_t sumBytes = 0;
+    std::uint32_t compressed = 0;
+};
+
+// Header for the histograms of a number of frames with the given dimensions and buckets
+PartialHeader partialHeader(int width, int height, int channels, int depth, int bucketSize, int buckets, int frames, bool compressed);
+
+// Read the header of a partial file, returns false if the file is missing or not a partial
+bool readPartialHeader(const std::string& fn, PartialHeader& header);
+
+// True when two partials count the same pixels into the same buckets and can be added together
+bool partialsMatch(const PartialHeader& first, const PartialHeader& second);
+
+// Writes the values of a partial file in the order they are handed over. Compressed partials
+// store a variable-length integer per value and the length of every run of zeros, which suits
+// the mostly empty histograms. The file is written under a temporary name and renamed once complete.
+class PartialWriter {
+public:
+    PartialWriter(const std::string& fn, const PartialHeader& header);
+    ~PartialWriter();
+
+    PartialWriter(const PartialWriter&) = delete;
+    PartialWriter& operator=(const PartialWriter&) = delete;
+
+    void writeCounts(const std::uint64_t* values, std::size_t count);
+    void writeSums(const std::uint64_t* values, std::size_t count);
+
+    // Write out the pending values and give the file its final name
+    void close();
+
+private:
+    void write(const std::uint64_t* values, std::size_t count, int bytes);
+    void putByte(unsigned char byte);
+    void putVarint(std::uint64_t value);
+    void flushZeros();
+    void flushBuffer();
+
+    std::string fileName;
+    std::string tempName;
+    std::FILE* file = nullptr;
+    PartialHeader partial;
+    std::vector<unsigned char> buffer;
+    std::uint64_t zeroRun = 0;
+};
+
+// Reads the values of a partial file back in the order they were written
+class PartialReader {
+public:
+    explicit PartialReader(const std::string& fn);
+    ~PartialReader();
+
+    PartialReader(const PartialReader&) = delete;
+    PartialReader& operator=(const PartialReader&) = delete;
+
+    const PartialHeader& header() const;
+
+    void readCounts(std::uint64_t* values, std::size_t count);
+    void readSums(std::uint64_t* values, std::size_t count);
+
+private:
+    void read(std::uint64_t* values, std::size_t count, int bytes);
+    unsigned char getByte();
+    std::uint64_t getVarint();
+
+    std::string fileName;
+    std::FILE* file = nullptr;
+    PartialHeader partial;
+    std::vector<unsigned char> buffer;
+    std::size_t bufferPos = 0;
+    std::uint64_t zeroRun = 0;
+};
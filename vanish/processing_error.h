@@ -0,0 +1,17 @@
+// ProcessingError
+// Error that ends the processing of one sequence
+
+#pragma once
+
+#include <stdexcept>
+#include <string>
+
+// Thrown when a sequence cannot be processed, such as a frame that cannot be read or does not
+// match the others. A single run exits with the message, a batch goes on with its next job.
+class ProcessingError : public std::runtime_error {
+public:
+    explicit ProcessingError(const std::string& message)
+        : std::runtime_error(message)
+    {
+    }
+};
@@ -0,0 +1,155 @@
+// ProcessorMetrics
+// Wall time of the processing phases, throughput and memory use of a run
+#include "processor_metrics.h"
+
+#include <fstream>
+#include <iomanip>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+namespace
+{
+    const double kMegapixel = 1.0e6;
+    const double kMegabyte = 1024.0 * 1024.0;
+
+    double perSecond(double amount, double seconds)
+    {
+        return seconds > 0.0 ? amount / seconds : 0.0;
+    }
+
+    double megapixels(const ProcessorMetrics& metrics)
+    {
+        return static_cast<double>(metrics.width) * metrics.height * metrics.frames / kMegapixel;
+    }
+
+    void printPhase(std::ostream& out, const char* name, double seconds, const ProcessorMetrics& metrics)
+    {
+        out << "\t" << name << std::setw(10) << seconds << " s";
+
+        if (metrics.totalSeconds > 0.0)
+        {
+            out << std::setw(8) << 100.0 * seconds / metrics.totalSeconds << " %";
+        }
+
+        out << std::endl;
+    }
+}
+
+PhaseTimer::PhaseTimer(double& phaseSeconds)
+    : seconds(phaseSeconds)
+    , start(std::chrono::steady_clock::now())
+{
+}
+
+PhaseTimer::~PhaseTimer()
+{
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    seconds += elapsed.count();
+}
+
+std::size_t peakResidentBytes()
+{
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS counters;
+
+    if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+    {
+        return counters.PeakWorkingSetSize;
+    }
+
+    return 0;
+#else
+    rusage usage;
+
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+    {
+        return 0;
+    }
+
+    // Linux reports kilobytes, macOS bytes
+#ifdef __APPLE__
+    return static_cast<std::size_t>(usage.ru_maxrss);
+#else
+    return static_cast<std::size_t>(usage.ru_maxrss) * 1024;
+#endif
+#endif
+}
+
+void printMetrics(std::ostream& out, const ProcessorMetrics& metrics)
+{
+    std::ios::fmtflags flags = out.flags();
+    std::streamsize precision = out.precision();
+
+    out << std::fixed << std::setprecision(3);
+
+    out << "Timing" << std::endl;
+
+    if (metrics.samplingSeconds > 0.0)
+    {
+        printPhase(out, "Sampling:   ", metrics.samplingSeconds, metrics);
+    }
+
+    printPhase(out, "Count:      ", metrics.countSeconds, metrics);
+    printPhase(out, "Mode:       ", metrics.modeSeconds, metrics);
+    printPhase(out, "1st pass:   ", metrics.firstPassSeconds, metrics);
+    printPhase(out, "Fail count: ", metrics.countFailedSeconds, metrics);
+    printPhase(out, "2nd pass:   ", metrics.secondPassSeconds, metrics);
+    printPhase(out, "Output:     ", metrics.outputSeconds, metrics);
+
+    out << "\tTotal:      " << std::setw(10) << metrics.totalSeconds << " s" << std::endl;
+    out << "\tDecode:     " << std::setw(10) << metrics.decodeSeconds << " s on the decoder threads, "
+        << metrics.decodeWaitSeconds << " s waited for" << std::endl;
+
+    out << std::setprecision(1);
+    out << "\tThroughput: " << std::setw(10) << perSecond(metrics.frames, metrics.totalSeconds) << " frames/s, "
+        << perSecond(megapixels(metrics), metrics.totalSeconds) << " MP/s" << std::endl;
+    out << "\tBuckets:    " << std::setw(10) << metrics.bucketBytes / kMegabyte << " MB" << std::endl;
+    out << "\tPeak RSS:   " << std::setw(10) << metrics.peakResidentBytes / kMegabyte << " MB" << std::endl;
+
+    out.flags(flags);
+    out.precision(precision);
+}
+
+bool writeMetricsJson(const std::string& fn, const ProcessorMetrics& metrics)
+{
+    std::ofstream json(fn);
+
+    if (!json)
+    {
+        return false;
+    }
+
+    json << std::setprecision(6);
+    json << "{" << std::endl;
+    json << "  \"frames\": " << metrics.frames << "," << std::endl;
+    json << "  \"width\": " << metrics.width << "," << std::endl;
+    json << "  \"height\": " << metrics.height << "," << std::endl;
+    json << "  \"channels\": " << metrics.channels << "," << std::endl;
+    json << "  \"depth\": " << metrics.depth << "," << std::endl;
+    json << "  \"counter_bits\": " << metrics.counterBits << "," << std::endl;
+    json << "  \"bands\": " << metrics.bands << "," << std::endl;
+    json << "  \"seconds\": {" << std::endl;
+    json << "    \"decode\": " << metrics.decodeSeconds << "," << std::endl;
+    json << "    \"decode_wait\": " << metrics.decodeWaitSeconds << "," << std::endl;
+    json << "    \"sampling\": " << metrics.samplingSeconds << "," << std::endl;
+    json << "    \"count\": " << metrics.countSeconds << "," << std::endl;
+    json << "    \"mode\": " << metrics.modeSeconds << "," << std::endl;
+    json << "    \"first_pass\": " << metrics.firstPassSeconds << "," << std::endl;
+    json << "    \"fail_count\": " << metrics.countFailedSeconds << "," << std::endl;
+    json << "    \"second_pass\": " << metrics.secondPassSeconds << "," << std::endl;
+    json << "    \"output\": " << metrics.outputSeconds << "," << std::endl;
+    json << "    \"total\": " << metrics.totalSeconds << std::endl;
+    json << "  }," << std::endl;
+    json << "  \"frames_per_second\": " << perSecond(metrics.frames, metrics.totalSeconds) << "," << std::endl;
+    json << "  \"megapixels_per_second\": " << perSecond(megapixels(metrics), metrics.totalSeconds) << "," << std::endl;
+    json << "  \"bucket_bytes\": " << metrics.bucketBytes << "," << std::endl;
+    json << "  \"peak_rss_bytes\": " << metrics.peakResidentBytes << std::endl;
+    json << "}" << std::endl;
+
+    return static_cast<bool>(json);
+}
@@ -0,0 +1,60 @@
+// ProcessorMetrics
+// Wall time of the processing phases, throughput and memory use of a run
+
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <ostream>
+#include <string>
+
+struct ProcessorMetrics {
+    int frames = 0;
+    int width = 0;
+    int height = 0;
+    int channels = 0;
+    int depth = 0;
+    int counterBits = 0;
+    int bands = 0;
+
+    // Time spent reading frames, summed over the decoder threads, and the part of it the passes waited for
+    double decodeSeconds = 0.0;
+    double decodeWaitSeconds = 0.0;
+
+    // Wall time of the phases, each including its waits for decoded frames
+    double samplingSeconds = 0.0;
+    double countSeconds = 0.0;
+    double modeSeconds = 0.0;
+    double firstPassSeconds = 0.0;
+    double countFailedSeconds = 0.0;
+    double secondPassSeconds = 0.0;
+    double outputSeconds = 0.0;
+    double totalSeconds = 0.0;
+
+    // Largest bucket data of any band, and the peak resident memory of the process
+    std::size_t bucketBytes = 0;
+    std::size_t peakResidentBytes = 0;
+};
+
+// Adds the wall time between construction and destruction to a counter
+class PhaseTimer {
+public:
+    explicit PhaseTimer(double& phaseSeconds);
+    ~PhaseTimer();
+
+    PhaseTimer(const PhaseTimer&) = delete;
+    PhaseTimer& operator=(const PhaseTimer&) = delete;
+
+private:
+    double& seconds;
+    std::chrono::steady_clock::time_point start;
+};
+
+// Peak resident memory of the process so far, zero where it is not available
+std::size_t peakResidentBytes();
+
+// Print the phase times and throughput in a human-readable table
+void printMetrics(std::ostream& out, const ProcessorMetrics& metrics);
+
+// Write the metrics to a JSON file, returns false if the file could not be written
+bool writeMetricsJson(const std::string& fn, const ProcessorMetrics& metrics);
@@ -1,14 +1,29 @@
 // Vanish
 // Remove transient objects from an image sequence
 
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <exception>
 #include <iostream>
+#include <map>
+#include <memory>
+#include <set>
 #include <string>
+#include <system_error>
+#include <thread>
 #include <vector>
 #include <filesystem>
 
 #include <cxxopts.hpp>
 
+#include "batch_runner.h"
+#include "bucket_kernels.h"
 #include "image_processor.h"
+#include "partial_state.h"
+#include "processing_error.h"
+#include "video_source.h"
 
 namespace
 {
@@ -16,6 +31,12 @@ namespace
     const int kDefaultBucketSize = 8;
     const int kDefaultBitDepth = 8;
     const float kDefaultConfidenceLevel = 0.2f;
+    const int kDefaultCacheMemory = 4096;
+    const int kDefaultLookahead = 8;
+    const std::string kDefaultLayout = "pixel";
+    const std::string kDefaultEstimator = "buckets";
+    const int kDefaultMaxMemory = 0;
+    const std::chrono::seconds kWatchInterval(1);
 
     const std::string kCmdHelp = "help";
     const std::string kCmdDirectory = "dir";
@@ -24,9 +45,221 @@ namespace
     const std::string kCmdDepth = "depth";
     const std::string kCmdSamples = "samples";
     const std::string kCmdConfidence = "conf";
+    const std::string kCmdCache = "cache";
+    const std::string kCmdDecoders = "decoders";
+    const std::string kCmdLookahead = "lookahead";
+    const std::string kCmdLayout = "layout";
+    const std::string kCmdBucketSums = "bucket-sums";
+    const std::string kCmdEstimator = "estimator";
+    const std::string kCmdSimd = "simd";
+    const std::string kCmdMaxMemory = "max-memory";
+    const std::string kCmdWatch = "watch";
+    const std::string kCmdWindow = "window";
+    const std::string kCmdHeadless = "headless";
+    const std::string kCmdBatch = "batch";
+    const std::string kCmdJobs = "jobs";
+    const std::string kCmdStack = "stack";
+    const std::string kCmdMetricsJson = "metrics-json";
+    const std::string kCmdVideo = "video";
+    const std::string kCmdRaw = "raw";
+    const std::string kCmdRange = "range";
+    const std::string kCmdPartial = "partial";
+    const std::string kCmdUncompressed = "uncompressed";
+    const std::string kCmdMerge = "merge";
+
+    // Parse a range of frames given as FIRST-LAST, counted from zero and including both ends
+    bool parseFrameRange(const std::string& text, int& first, int& last)
+    {
+        char extra = 0;
+
+        return std::sscanf(text.c_str(), "%d-%d%c", &first, &last, &extra) == 2 && first >= 0 && last >= first;
+    }
+
+    // Run the image processor with the given bucket counter and pixel types on the files, or on the video if there is one.
+    // Given partial files are merged, with the passes over the frames.
+    template <typename CountType, typename PixelType>
+    void processFiles(const ProcessorSettings& settings, const std::vector<std::string>& fileNames, std::unique_ptr<FrameSource> video, const VideoFormat& format,
+        const std::vector<std::string>& partialFiles)
+    {
+        ImageProcessor<CountType, PixelType> processor;
+        processor.setSettings(settings);
+
+        if (video)
+        {
+            processor.setFrameSource(std::move(video), format.width, format.height, format.channels);
+        }
+        else
+        {
+            processor.setFiles(fileNames);
+        }
+
+        // Process the specified image sequence, merge the partials over it, or write a background for every frame
+        if (!partialFiles.empty())
+        {
+            processor.mergePartials(partialFiles);
+        }
+        else if (settings.window > 0)
+        {
+            processor.processWindow(settings.window);
+        }
+        else
+        {
+            processor.processSequence();
+        }
+    }
+
+    // Use the smallest bucket counters that can count every frame, or every frame of the window
+    template <typename PixelType>
+    void processFiles(const ProcessorSettings& settings, const std::vector<std::string>& fileNames, std::unique_ptr<FrameSource> video, const VideoFormat& format,
+        const std::vector<std::string>& partialFiles)
+    {
+        int countedFrames = video ? video->frameCount() : static_cast<int>(fileNames.size());
+
+        if (settings.window > 0)
+        {
+            countedFrames = std::min(countedFrames, settings.window);
+        }
+
+        int counterBits = processorCounterBits(countedFrames);
+
+        if (counterBits == 8)
+        {
+            processFiles<std::uint8_t, PixelType>(settings, fileNames, std::move(video), format, partialFiles);
+        }
+        else if (counterBits == 16)
+        {
+            processFiles<std::uint16_t, PixelType>(settings, fileNames, std::move(video), format, partialFiles);
+        }
+        else
+        {
+            processFiles<std::uint32_t, PixelType>(settings, fileNames, std::move(video), format, partialFiles);
+        }
+    }
+
+    // Merge the partial files with the given bucket counter and pixel types, without frames to read
+    template <typename CountType, typename PixelType>
+    void mergePartials(const ProcessorSettings& settings, const std::vector<std::string>& partialFiles)
+    {
+        ImageProcessor<CountType, PixelType> processor;
+        processor.setSettings(settings);
+        processor.mergePartials(partialFiles);
+    }
+
+    // Use the smallest bucket counters that can count the frames of every partial
+    template <typename PixelType>
+    void mergePartials(const ProcessorSettings& settings, const std::vector<std::string>& partialFiles, int partialFrames)
+    {
+        int counterBits = processorCounterBits(partialFrames);
+
+        if (counterBits == 8)
+        {
+            mergePartials<std::uint8_t, PixelType>(settings, partialFiles);
+        }
+        else if (counterBits == 16)
+        {
+            mergePartials<std::uint16_t, PixelType>(settings, partialFiles);
+        }
+        else
+        {
+            mergePartials<std::uint32_t, PixelType>(settings, partialFiles);
+        }
+    }
+
+    // Add the files in the directory to a streaming background as they arrive, and write out
+    // the background after every scan that found new frames. Runs until interrupted.
+    template <typename PixelType>
+    void watchDirectory(const ProcessorSettings& settings, const std::filesystem::path& imagePath, const std::string& fileExtension)
+    {
+        // The final number of frames is unknown, so use the widest counters
+        ImageProcessor<std::uint32_t, PixelType> processor;
+        processor.setSettings(settings);
+
+        std::set<std::string> added;
+        std::map<std::string, std::uintmax_t> pending;
+        int frameCount = 0;
+
+        std::cout << "Watching " << imagePath.string() << " for new frames..." << std::endl;
+
+        while (true)
+        {
+            std::vector<std::string> ready;
+
+            for (std::filesystem::directory_iterator itr(imagePath); itr != std::filesystem::directory_iterator(); ++itr)
+            {
+                // Files can disappear between the scan and the checks, so the checks report errors instead of throwing
+                std::error_code error;
+
+                if (!std::filesystem::is_regular_file(*itr, error) || itr->path().extension() != std::string(".") + fileExtension)
+                {
+                    continue;
+                }
+
+                std::string fileName = itr->path().string();
+
+                if (added.count(fileName) == 1)
+                {
+                    continue;
+                }
+
+                // A file is only read once its size is the same on two scans, so frames still being written are skipped
+                std::uintmax_t fileSize = std::filesystem::file_size(*itr, error);
+
+                if (error)
+                {
+                    pending.erase(fileName);
+                    continue;
+                }
+
+                auto previous = pending.find(fileName);
+
+                if (previous != pending.end() && previous->second == fileSize)
+                {
+                    ready.push_back(fileName);
+                }
+                else
+                {
+                    pending[fileName] = fileSize;
+                }
+            }
+
+            std::sort(ready.begin(), ready.end());
+
+            bool updated = false;
+
+            // A bad file is skipped for good, the watcher keeps running on the other frames
+            for (const auto& fileName : ready)
+            {
+                added.insert(fileName);
+                pending.erase(fileName);
+
+                try
+                {
+                    processor.addFile(fileName);
+                }
+                catch (const std::exception& error)
+                {
+                    std::cerr << "Could not read " << fileName << ": " << error.what() << " Skipping." << std::endl;
+                    continue;
+                }
+
+                updated = true;
+                frameCount++;
+            }
+
+            if (updated)
+            {
+                processor.currentBackground();
+                processor.saveImages();
+
+                std::cout << "Background updated with " << frameCount << " frames" << std::endl;
+            }
+
+            std::this_thread::sleep_for(kWatchInterval);
+        }
+    }
 }
 
-int main(int argc, char* argv[])
+int runVanish(int argc, char* argv[])
 {
     std::cout << "Vanish - Version 0.06 Alpha" << std::endl << std::endl;
 
@@ -37,49 +270,484 @@ int main(int argc, char* argv[])
         (kCmdDirectory, "directory of input image sequence", cxxopts::value<std::string>())
         (kCmdType, "file extension", cxxopts::value<std::string>())
         (kCmdBucket, "bucket size", cxxopts::value<int>()->default_value(std::to_string(kDefaultBucketSize)))
-        (kCmdDepth, "channel bit depth", cxxopts::value<int>())
+        (kCmdDepth, "channel bit depth, 8 to 16", cxxopts::value<int>())
         (kCmdSamples, "number of samples for bad frame detection", cxxopts::value<int>())
-        (kCmdConfidence, "confidence level [0.0, 1.0]", cxxopts::value<float>()->default_value(std::to_string(kDefaultConfidenceLevel)));
+        (kCmdConfidence, "confidence level [0.0, 1.0], or a comma separated list of levels written to separate images", cxxopts::value<std::vector<float>>()->default_value(std::to_string(kDefaultConfidenceLevel)))
+        (kCmdCache, "memory for decoded frames in MB, the rest is spilled to disk", cxxopts::value<int>()->default_value(std::to_string(kDefaultCacheMemory)))
+        (kCmdDecoders, "number of frame decoder threads (default: hardware threads)", cxxopts::value<int>())
+        (kCmdLookahead, "number of frames decoded ahead of processing", cxxopts::value<int>()->default_value(std::to_string(kDefaultLookahead)))
+        (kCmdLayout, "bucket memory layout, pixel or bucket", cxxopts::value<std::string>()->default_value(kDefaultLayout))
+        (kCmdBucketSums, "also sum the values of every bucket while counting, which replaces the first pass over the frames but takes 4 more bytes per bucket")
+        (kCmdEstimator, "background estimator, buckets or clusters, which keeps a few colors per pixel and reads the frames once", cxxopts::value<std::string>()->default_value(kDefaultEstimator))
+        (kCmdSimd, "limit the kernel instruction set to scalar, sse4.1 or avx2 (default: best available)", cxxopts::value<std::string>())
+        (kCmdMaxMemory, "peak memory in MB, larger images are processed in bands of rows (default: no limit)", cxxopts::value<int>())
+        (kCmdWatch, "keep running and update the background as new files arrive in the directory")
+        (kCmdWindow, "write a background for every frame over a sliding window of this many frames", cxxopts::value<int>())
+        (kCmdHeadless, "write the output files and exit without opening the viewer")
+        (kCmdBatch, "process every sequence listed in a manifest file, one input directory and optional output directory per line", cxxopts::value<std::string>())
+        (kCmdJobs, "number of batch sequences processed at once", cxxopts::value<int>()->default_value("1"))
+        (kCmdStack, "keep the decoded frames in this raw file, written on the first run and mapped by later runs", cxxopts::value<std::string>())
+        (kCmdMetricsJson, "write the phase times, throughput and memory use of the run to this JSON file", cxxopts::value<std::string>())
+        (kCmdVideo, "read the frames from an uncompressed YUV4MPEG2 video instead of a directory, - reads standard input", cxxopts::value<std::string>())
+        (kCmdRaw, "the video holds raw planar frames of this size, WIDTHxHEIGHT or WIDTHxHEIGHTxCHANNELS, with samples of --depth", cxxopts::value<std::string>())
+        (kCmdRange, "only process the frames FIRST-LAST of the sequence, counted from zero", cxxopts::value<std::string>())
+        (kCmdPartial, "write the bucket histograms of the frames to this partial file instead of the output images", cxxopts::value<std::string>())
+        (kCmdUncompressed, "store the partial file without compression, at the width of the counters and sums")
+        (kCmdMerge, "add up a comma separated list of partial files of one sequence and create the output images; the passes read the frames of --dir or --video when given, otherwise both are taken from the bucket sums", cxxopts::value<std::vector<std::string>>());
 
     auto arguments = options.parse(argc, argv);
 
-    if (arguments.count(kCmdDirectory) != 1)
+    bool batch = arguments.count(kCmdBatch) == 1;
+    bool videoInput = arguments.count(kCmdVideo) == 1;
+    bool merge = arguments.count(kCmdMerge) > 0;
+
+    // A merge reads the frames of the sequence when it is given
+    bool mergeFrames = merge && (videoInput || arguments.count(kCmdDirectory) == 1);
+
+    if (!batch && !videoInput && !merge && arguments.count(kCmdDirectory) != 1)
     {
         std::cout << "Invalid command line arguments - Directory not specified." << std::endl;
         std::cout << options.help() << std::endl;
         return EXIT_FAILURE;
     }
 
-    if (arguments.count(kCmdType) != 1)
+    if (!videoInput && (!merge || mergeFrames) && arguments.count(kCmdType) != 1)
     {
         std::cout << "Invalid command line arguments - File type extension not specified." << std::endl;
         std::cout << options.help() << std::endl;
         return EXIT_FAILURE;
     }
 
-    std::string inputDirectory = arguments[kCmdDirectory].as<std::string>();
-    std::string fileExtension = arguments[kCmdType].as<std::string>();
+    std::string inputDirectory = batch || videoInput || (merge && !mergeFrames) ? std::string() : arguments[kCmdDirectory].as<std::string>();
+    std::string fileExtension = videoInput || (merge && !mergeFrames) ? std::string() : arguments[kCmdType].as<std::string>();
 
     int bucketSize = kDefaultBucketSize;
     if(arguments.count(kCmdBucket) == 1)
     {
-        bucketSize = std::stoi(arguments[kCmdBucket].as<std::string>());
+        bucketSize = arguments[kCmdBucket].as<int>();
     }
 
     int bitDepth = kDefaultBitDepth;
     if(arguments.count(kCmdDepth) == 1)
     {
-        bitDepth = std::stoi(arguments[kCmdDepth].as<std::string>());
+        bitDepth = arguments[kCmdDepth].as<int>();
+    }
+
+    int samples = 0;
+    if(arguments.count(kCmdSamples) == 1)
+    {
+        samples = arguments[kCmdSamples].as<int>();
+    }
+
+    std::vector<float> confLevels(1, kDefaultConfidenceLevel);
+    if(arguments.count(kCmdConfidence) > 0)
+    {
+        confLevels = arguments[kCmdConfidence].as<std::vector<float>>();
+    }
+
+    int cacheMemory = kDefaultCacheMemory;
+    if(arguments.count(kCmdCache) == 1)
+    {
+        cacheMemory = arguments[kCmdCache].as<int>();
+    }
+
+    int decoderThreads = std::max(static_cast<int>(std::thread::hardware_concurrency()), 1);
+    if(arguments.count(kCmdDecoders) == 1)
+    {
+        decoderThreads = arguments[kCmdDecoders].as<int>();
+    }
+
+    int maxMemory = kDefaultMaxMemory;
+    if(arguments.count(kCmdMaxMemory) == 1)
+    {
+        maxMemory = arguments[kCmdMaxMemory].as<int>();
+    }
+
+    int window = 0;
+    if(arguments.count(kCmdWindow) == 1)
+    {
+        window = arguments[kCmdWindow].as<int>();
+    }
+
+    int concurrentJobs = 1;
+    if(arguments.count(kCmdJobs) == 1)
+    {
+        concurrentJobs = arguments[kCmdJobs].as<int>();
+    }
+
+    int lookahead = kDefaultLookahead;
+    if(arguments.count(kCmdLookahead) == 1)
+    {
+        lookahead = arguments[kCmdLookahead].as<int>();
+    }
+
+    std::string layout = kDefaultLayout;
+    if(arguments.count(kCmdLayout) == 1)
+    {
+        layout = arguments[kCmdLayout].as<std::string>();
+    }
+
+    std::string estimator = kDefaultEstimator;
+    if(arguments.count(kCmdEstimator) == 1)
+    {
+        estimator = arguments[kCmdEstimator].as<std::string>();
+    }
+
+    // Check the bit depth
+    if (bitDepth < 8 || bitDepth > 16)
+    {
+        std::cerr << "Invalid bit depth. Using default value." << std::endl;
+        bitDepth = kDefaultBitDepth;
+    }
+
+    // The whole video is read here, a YUV4MPEG2 video gives its own bit depth
+    std::unique_ptr<VideoFrameSource> video;
+
+    if (videoInput)
+    {
+        std::string videoFile = arguments[kCmdVideo].as<std::string>();
+        std::size_t videoMemory = static_cast<std::size_t>(std::max(cacheMemory, 0)) << 20;
+
+        if (arguments.count(kCmdRaw) == 1)
+        {
+            VideoFormat format;
+            format.depth = bitDepth;
+
+            if (!parseRawGeometry(arguments[kCmdRaw].as<std::string>(), format))
+            {
+                std::cerr << "Invalid raw frame size. Exiting." << std::endl;
+                return EXIT_FAILURE;
+            }
+
+            video = VideoFrameSource::openRaw(videoFile, format, videoMemory);
+        }
+        else
+        {
+            video = VideoFrameSource::openY4m(videoFile, videoMemory);
+
+            if (arguments.count(kCmdDepth) == 1 && bitDepth != video->format().depth)
+            {
+                std::cerr << "The video has a bit depth of " << video->format().depth << ". Using it instead." << std::endl;
+            }
+
+            bitDepth = video->format().depth;
+        }
+
+        if (video->frameCount() < 2)
+        {
+            std::cerr << "Not enough frames found in video " << videoFile << "! Terminating." << std::endl;
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // Deeper images keep the number of buckets of the default bucket size
+    int defaultBucketSize = kDefaultBucketSize << (bitDepth - kDefaultBitDepth);
+
+    if (arguments.count(kCmdBucket) == 0)
+    {
+        bucketSize = defaultBucketSize;
+    }
+
+    // Partials keep the bit depth and bucket size they were counted with
+    std::vector<std::string> partialFiles;
+    int partialFrames = 0;
+
+    if (merge)
+    {
+        partialFiles = arguments[kCmdMerge].as<std::vector<std::string>>();
+
+        for (const auto& partialFile : partialFiles)
+        {
+            PartialHeader header;
+
+            if (!readPartialHeader(partialFile, header))
+            {
+                std::cerr << "Could not read partial file " << partialFile << "! Exiting." << std::endl;
+                return EXIT_FAILURE;
+            }
+
+            if (video && static_cast<int>(header.depth) != video->format().depth)
+            {
+                std::cerr << "Partial file " << partialFile << " was counted at another bit depth than the video! Exiting." << std::endl;
+                return EXIT_FAILURE;
+            }
+
+            partialFrames += static_cast<int>(header.frames);
+            bitDepth = static_cast<int>(header.depth);
+            bucketSize = static_cast<int>(header.bucketSize);
+        }
+
+        if (arguments.count(kCmdDepth) == 1 || arguments.count(kCmdBucket) == 1)
+        {
+            std::cerr << "Using the bit depth and bucket size of the partial files." << std::endl;
+        }
+    }
+
+    // Check the bucket size
+    if (bucketSize < 1 || bucketSize > (1 << bitDepth) / 2) 
+    {
+        std::cerr << "Invalid bucket size. Using default value." << std::endl;
+        bucketSize = defaultBucketSize;
+    }
+
+    // Check the number of samples for bad frame detection
+    if (samples < 0)
+    {
+        std::cerr << "Invalid number of samples. Keeping every frame." << std::endl;
+        samples = 0;
+    }
+
+    // Bad frames are found and frames are stacked by file, a video is read as it is
+    if (samples > 0 && videoInput)
+    {
+        std::cerr << "--video does not support --samples. Keeping every frame." << std::endl;
+        samples = 0;
+    }
+
+    // Check the confidence levels
+    for (auto& confLevel : confLevels)
+    {
+        if (confLevel < 0.0f || confLevel > 1.0f)
+        {
+            std::cerr << "Invalid confidence level. Using default value." << std::endl;
+            confLevel = kDefaultConfidenceLevel;
+        }
+    }
+
+    // Check the frame cache size
+    if (cacheMemory < 0)
+    {
+        std::cerr << "Invalid frame cache size. Using default value." << std::endl;
+        cacheMemory = kDefaultCacheMemory;
+    }
+
+    // Check the memory limit
+    if (maxMemory < 0)
+    {
+        std::cerr << "Invalid memory limit. Processing without a limit." << std::endl;
+        maxMemory = kDefaultMaxMemory;
+    }
+
+    // Check the sliding window
+    if (window < 0)
+    {
+        std::cerr << "Invalid window size. Processing the whole sequence." << std::endl;
+        window = 0;
+    }
+
+    // A watched directory has no end, so it is always processed as a whole
+    if (window > 0 && arguments.count(kCmdWatch) == 1)
+    {
+        std::cerr << "--watch does not support --window. Watching without a window." << std::endl;
+        window = 0;
+    }
+
+    // Partials hold the histograms of the whole sequence
+    if (window > 0 && merge)
+    {
+        std::cerr << "--merge does not support --window. Merging the whole sequence." << std::endl;
+        window = 0;
+    }
+
+    if (merge && arguments.count(kCmdWatch) == 1)
+    {
+        std::cerr << "--merge does not support --watch. Merging the files in the directory." << std::endl;
+    }
+
+    // Check the number of batch jobs run at once
+    if (concurrentJobs < 1)
+    {
+        std::cerr << "Invalid number of jobs. Running one job at a time." << std::endl;
+        concurrentJobs = 1;
+    }
+
+    // Check the decoder pipeline settings, zero decoders reads frames on the main thread
+    if (decoderThreads < 0)
+    {
+        std::cerr << "Invalid number of decoder threads. Decoding on the main thread." << std::endl;
+        decoderThreads = 0;
+    }
+
+    if (lookahead < 1)
+    {
+        std::cerr << "Invalid lookahead. Using default value." << std::endl;
+        lookahead = kDefaultLookahead;
+    }
+
+    // Limit the instruction set of the kernels
+    if (arguments.count(kCmdSimd) == 1)
+    {
+        std::string simd = arguments[kCmdSimd].as<std::string>();
+
+        if (simd == "scalar")
+        {
+            setSimdLevel(SimdLevel::Scalar);
+        }
+        else if (simd == "sse4.1")
+        {
+            setSimdLevel(SimdLevel::Sse41);
+        }
+        else if (simd != "avx2")
+        {
+            std::cerr << "Invalid instruction set. Using the best available." << std::endl;
+        }
+    }
+
+    // Check the bucket layout
+    if (layout != "pixel" && layout != "bucket")
+    {
+        std::cerr << "Invalid bucket layout. Using default value." << std::endl;
+        layout = kDefaultLayout;
+    }
+
+    // Check the estimator, streams and windows remove frames and always use the buckets
+    if (estimator != "buckets" && estimator != "clusters")
+    {
+        std::cerr << "Invalid estimator. Using default value." << std::endl;
+        estimator = kDefaultEstimator;
+    }
+
+    if (estimator == "clusters" && (window > 0 || arguments.count(kCmdWatch) == 1))
+    {
+        std::cerr << "The cluster estimator does not support --watch or --window. Using buckets." << std::endl;
+        estimator = kDefaultEstimator;
+    }
+
+    // Check the partial file, which holds the histograms of a whole run
+    std::string partialFile;
+    if (arguments.count(kCmdPartial) == 1)
+    {
+        partialFile = arguments[kCmdPartial].as<std::string>();
+    }
+
+    if (!partialFile.empty() && (window > 0 || batch || arguments.count(kCmdWatch) == 1))
+    {
+        std::cerr << "Partial files are not written with --watch, --window or --batch. Creating the output images." << std::endl;
+        partialFile.clear();
+    }
+
+    if (estimator == "clusters" && (!partialFile.empty() || merge))
+    {
+        std::cerr << "Partial files hold bucket histograms. Using buckets." << std::endl;
+        estimator = kDefaultEstimator;
+    }
+
+    ProcessorSettings settings;
+    settings.depth = bitDepth;
+    settings.bucketSize = bucketSize;
+    settings.confLevels = confLevels;
+    settings.samples = samples;
+    settings.memoryBudget = static_cast<std::size_t>(cacheMemory) << 20;
+    settings.decoderThreads = decoderThreads;
+    settings.lookahead = lookahead;
+    settings.layout = layout == "pixel" ? BucketLayout::PixelMajor : BucketLayout::BucketMajor;
+    settings.bucketSums = arguments.count(kCmdBucketSums) == 1;
+    settings.estimator = estimator == "clusters" ? Estimator::Clusters : Estimator::Buckets;
+    settings.maxMemory = static_cast<std::size_t>(maxMemory) << 20;
+    settings.window = window;
+    settings.headless = arguments.count(kCmdHeadless) == 1;
+
+    if (arguments.count(kCmdStack) == 1 && videoInput)
+    {
+        std::cerr << "--video does not support --stack. Reading the frames from the video." << std::endl;
+    }
+    else if (arguments.count(kCmdStack) == 1)
+    {
+        settings.frameStack = arguments[kCmdStack].as<std::string>();
+    }
+
+    if (arguments.count(kCmdMetricsJson) == 1)
+    {
+        settings.metricsFile = arguments[kCmdMetricsJson].as<std::string>();
     }
 
-    float confLevel = kDefaultConfidenceLevel;
-    if(arguments.count(kCmdConfidence) == 1)
+    settings.partialFile = partialFile;
+    settings.compressPartial = arguments.count(kCmdUncompressed) == 0;
+
+    // Frames of the sequence given by --range
+    int firstFrame = 0;
+    int lastFrame = -1;
+
+    if (arguments.count(kCmdRange) == 1 && !parseFrameRange(arguments[kCmdRange].as<std::string>(), firstFrame, lastFrame))
+    {
+        std::cerr << "Invalid frame range. Exiting." << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    if (lastFrame >= 0 && arguments.count(kCmdWatch) == 1)
+    {
+        std::cerr << "--watch does not support --range. Watching every frame." << std::endl;
+        firstFrame = 0;
+        lastFrame = -1;
+    }
+
+    // Images deeper than 8 bits are read as 16-bit samples
+    bool deep = bitDepth > kDefaultBitDepth;
+
+    if (merge && !mergeFrames)
     {
-        confLevel = std::stof(arguments[kCmdConfidence].as<std::string>());
+        if (deep)
+        {
+            mergePartials<std::uint16_t>(settings, partialFiles, partialFrames);
+        }
+        else
+        {
+            mergePartials<std::uint8_t>(settings, partialFiles, partialFrames);
+        }
+
+        return EXIT_SUCCESS;
+    }
+
+    if (video)
+    {
+        VideoFormat format = video->format();
+        std::unique_ptr<FrameSource> videoFrames = std::move(video);
+
+        if (lastFrame >= 0)
+        {
+            if (lastFrame >= videoFrames->frameCount())
+            {
+                std::cerr << "Frame range outside the " << videoFrames->frameCount() << " frames of the video! Terminating." << std::endl;
+                return EXIT_FAILURE;
+            }
+
+            if (lastFrame == firstFrame)
+            {
+                std::cerr << "Not enough frames in the frame range! Terminating." << std::endl;
+                return EXIT_FAILURE;
+            }
+
+            std::vector<int> rangeFrames;
+
+            for (int frame = firstFrame; frame <= lastFrame; frame++)
+            {
+                rangeFrames.push_back(frame);
+            }
+
+            videoFrames.reset(new FrameSubset(std::move(videoFrames), rangeFrames));
+        }
+
+        if (deep)
+        {
+            processFiles<std::uint16_t>(settings, std::vector<std::string>(), std::move(videoFrames), format, partialFiles);
+        }
+        else
+        {
+            processFiles<std::uint8_t>(settings, std::vector<std::string>(), std::move(videoFrames), format, partialFiles);
+        }
+
+        return EXIT_SUCCESS;
+    }
+
+    if (batch)
+    {
+        BatchRunner runner(settings, fileExtension, concurrentJobs);
+        int failed = runner.run(readManifest(arguments[kCmdBatch].as<std::string>()));
+
+        return failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
     }
 
     // Find image files
-    std::vector<std::string> fileNames;
     std::filesystem::path imagePath(inputDirectory);
 
     // Check that directory exists
@@ -89,43 +757,64 @@ int main(int argc, char* argv[])
         return EXIT_FAILURE;
     }
 
-    std::filesystem::directory_iterator endItr;
-    if (std::filesystem::is_directory(imagePath)) 
+    std::vector<std::string> fileNames = findFrameFiles(inputDirectory, fileExtension);
+
+    bool watch = arguments.count(kCmdWatch) == 1 && !merge;
+
+    if (lastFrame >= 0)
     {
-        for (std::filesystem::directory_iterator itr(imagePath); itr != endItr; ++itr) 
+        if (lastFrame >= static_cast<int>(fileNames.size()))
         {
-            if (std::filesystem::is_regular_file(*itr)) 
-            {
-                if (itr->path().extension() == std::string(".") + fileExtension) 
-                {
-                    fileNames.push_back(itr->path().string());
-                }
-            }
+            std::cerr << "Frame range outside the " << fileNames.size() << " files in directory " << inputDirectory << "! Terminating." << std::endl;
+            return EXIT_FAILURE;
         }
+
+        fileNames = std::vector<std::string>(fileNames.begin() + firstFrame, fileNames.begin() + lastFrame + 1);
     }
 
     // Check that enough image files were found
-    if (fileNames.size() < 2) 
+    if (!watch && fileNames.size() < 2) 
     {
         std::cerr << "Not enough files found in directory " << inputDirectory << "! Terminating." << std::endl;
         exit(EXIT_FAILURE);
     }
 
-    // Check the bucket size
-    if (bucketSize < 1 || bucketSize > 128) 
+    if (watch)
     {
-        std::cerr << "Invalid bucket size. Using default value." << std::endl;
-        bucketSize = kDefaultBucketSize;
-    }
+        if (deep)
+        {
+            watchDirectory<std::uint16_t>(settings, imagePath, fileExtension);
+        }
+        else
+        {
+            watchDirectory<std::uint8_t>(settings, imagePath, fileExtension);
+        }
 
-    // Set up the parameters for the image processor
-    ImageProcessor processor;
-    processor.setBucketSize(bucketSize);
-    processor.setConfidenceLevel(confLevel);
-    processor.setFiles(fileNames);
+        return EXIT_SUCCESS;
+    }
 
-    // Process the specified image sequence
-    processor.processSequence();
+    if (deep)
+    {
+        processFiles<std::uint16_t>(settings, fileNames, nullptr, VideoFormat(), partialFiles);
+    }
+    else
+    {
+        processFiles<std::uint8_t>(settings, fileNames, nullptr, VideoFormat(), partialFiles);
+    }
 
     return EXIT_SUCCESS;
 }
+
+// Errors of the sequence end the run
+int main(int argc, char* argv[])
+{
+    try
+    {
+        return runVanish(argc, argv);
+    }
+    catch (const ProcessingError& error)
+    {
+        std::cerr << std::endl << error.what() << " Exiting." << std::endl;
+        return EXIT_FAILURE;
+    }
+}
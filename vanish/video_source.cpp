@@ -0,0 +1,698 @@
+// VideoSource
+// Frames of an uncompressed video, YUV4MPEG2 or raw planar, read from a file or a pipe
+#include "video_source.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include <sstream>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <fcntl.h>
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+namespace
+{
+    const char* const kY4mMagic = "YUV4MPEG2";
+    const char* const kFrameMarker = "FRAME";
+    const std::size_t kFrameMarkerBytes = 5;
+    const std::size_t kMaxHeaderBytes = 4096;
+    const char* const kStandardInput = "-";
+
+    // BT.601 conversion from YUV to RGB in 16-bit fixed point
+    struct YuvMatrix {
+        int luma;
+        int crToR;
+        int cbToG;
+        int crToG;
+        int cbToB;
+    };
+
+    const YuvMatrix kVideoRange = {76309, 104597, 25675, 53279, 132201};
+    const YuvMatrix kFullRange = {65536, 91881, 22554, 46802, 116130};
+    const int kFixedShift = 16;
+    const std::int64_t kFixedHalf = 1 << (kFixedShift - 1);
+
+    int sampleBytesOf(const VideoFormat& format)
+    {
+        return format.depth > 8 ? 2 : 1;
+    }
+
+    // Size of the chroma planes of a YUV frame
+    void chromaSize(const VideoFormat& format, int& chromaWidth, int& chromaHeight)
+    {
+        chromaWidth = format.sampling == VideoSampling::Yuv444 ? format.width : (format.width + 1) / 2;
+        chromaHeight = format.sampling == VideoSampling::Yuv420 ? (format.height + 1) / 2 : format.height;
+    }
+
+    // Bytes of a frame as stored in the video
+    std::size_t videoFrameBytes(const VideoFormat& format)
+    {
+        std::size_t plane = static_cast<std::size_t>(format.width) * format.height;
+
+        if (format.sampling == VideoSampling::Planar)
+        {
+            return plane * format.channels * sampleBytesOf(format);
+        }
+
+        if (format.sampling == VideoSampling::Mono)
+        {
+            return plane * sampleBytesOf(format);
+        }
+
+        int chromaWidth = 0;
+        int chromaHeight = 0;
+        chromaSize(format, chromaWidth, chromaHeight);
+
+        return (plane + 2 * static_cast<std::size_t>(chromaWidth) * chromaHeight) * sampleBytesOf(format);
+    }
+
+    // Parse the sample depth at the end of a colorspace, such as the 10 of 420p10 or mono10
+    bool parseColorDepth(const std::string& text, int& depth)
+    {
+        if (text.empty())
+        {
+            depth = 8;
+            return true;
+        }
+
+        if (text.find_first_not_of("0123456789") != std::string::npos)
+        {
+            return false;
+        }
+
+        depth = std::atoi(text.c_str());
+
+        return true;
+    }
+
+    // Parse the header line of a YUV4MPEG2 video. Interlacing, frame rate and aspect ratio do not
+    // matter for the background and are ignored, like the chroma siting of the 4:2:0 variants.
+    bool parseY4mHeader(const std::string& line, VideoFormat& format)
+    {
+        std::istringstream fields(line);
+        std::string field;
+
+        if (!(fields >> field) || field != kY4mMagic)
+        {
+            return false;
+        }
+
+        std::string colorspace = "420jpeg";
+
+        format = VideoFormat();
+
+        while (fields >> field)
+        {
+            std::string value = field.substr(1);
+
+            switch (field[0])
+            {
+            case 'W':
+                format.width = std::atoi(value.c_str());
+                break;
+            case 'H':
+                format.height = std::atoi(value.c_str());
+                break;
+            case 'C':
+                colorspace = value;
+                break;
+            case 'X':
+                format.fullRange = format.fullRange || value == "COLORRANGE=FULL";
+                break;
+            default:
+                break;
+            }
+        }
+
+        bool valid = false;
+
+        if (colorspace.compare(0, 4, "mono") == 0)
+        {
+            format.sampling = VideoSampling::Mono;
+            valid = parseColorDepth(colorspace.substr(4), format.depth);
+        }
+        else if (colorspace.size() >= 3)
+        {
+            std::string subsampling = colorspace.substr(0, 3);
+            std::string variant = colorspace.substr(3);
+
+            if (subsampling == "444")
+            {
+                format.sampling = VideoSampling::Yuv444;
+            }
+            else if (subsampling == "422")
+            {
+                format.sampling = VideoSampling::Yuv422;
+            }
+            else if (subsampling == "420")
+            {
+                format.sampling = VideoSampling::Yuv420;
+            }
+
+            if (format.sampling != VideoSampling::Planar)
+            {
+                if (!variant.empty() && variant[0] == 'p')
+                {
+                    valid = parseColorDepth(variant.substr(1), format.depth);
+                }
+                else
+                {
+                    format.depth = 8;
+                    valid = variant.empty() || variant == "jpeg" || variant == "paldv" || variant == "mpeg2";
+                }
+            }
+        }
+
+        if (!valid)
+        {
+            std::cerr << "Unsupported YUV4MPEG2 colorspace " << colorspace << "! Exiting." << std::endl;
+            exit(EXIT_FAILURE);
+        }
+
+        format.channels = 3;
+
+        return format.width > 0 && format.height > 0 && format.depth >= 8 && format.depth <= 16;
+    }
+
+    // Read a line of a stream without the newline, returns false at the end of the stream
+    bool readLine(std::FILE* file, std::string& line)
+    {
+        line.clear();
+
+        int c = std::fgetc(file);
+
+        if (c == EOF)
+        {
+            return false;
+        }
+
+        while (c != EOF && c != '\n' && line.size() < kMaxHeaderBytes)
+        {
+            line.push_back(static_cast<char>(c));
+            c = std::fgetc(file);
+        }
+
+        return true;
+    }
+
+    // Open a video that can only be read once, "-" is standard input
+    std::FILE* openStream(const std::string& fn)
+    {
+        if (fn == kStandardInput)
+        {
+#ifdef _WIN32
+            _setmode(_fileno(stdin), _O_BINARY);
+#endif
+            return stdin;
+        }
+
+        std::FILE* file = std::fopen(fn.c_str(), "rb");
+
+        if (!file)
+        {
+            std::cerr << "Could not open video " << fn << "! Exiting." << std::endl;
+            exit(EXIT_FAILURE);
+        }
+
+        return file;
+    }
+
+    void closeStream(std::FILE* file)
+    {
+        if (file != stdin)
+        {
+            std::fclose(file);
+        }
+    }
+
+    // Map a whole file read-only, returns nullptr if it cannot be mapped
+    const unsigned char* mapVideo(const std::string& fn, std::size_t& bytes)
+    {
+        std::error_code error;
+        std::uintmax_t fileSize = std::filesystem::file_size(fn, error);
+
+        if (error || fileSize == 0)
+        {
+            return nullptr;
+        }
+
+        bytes = static_cast<std::size_t>(fileSize);
+
+        // The handles can be closed right away, the mapping keeps the file open
+#ifdef _WIN32
+        HANDLE file = CreateFileA(fn.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+
+        if (file == INVALID_HANDLE_VALUE)
+        {
+            return nullptr;
+        }
+
+        HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        CloseHandle(file);
+
+        if (!mapping)
+        {
+            return nullptr;
+        }
+
+        const unsigned char* data = static_cast<const unsigned char*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+        CloseHandle(mapping);
+
+        return data;
+#else
+        int file = ::open(fn.c_str(), O_RDONLY);
+
+        if (file < 0)
+        {
+            return nullptr;
+        }
+
+        void* mapping = mmap(nullptr, bytes, PROT_READ, MAP_SHARED, file, 0);
+        ::close(file);
+
+        return mapping == MAP_FAILED ? nullptr : static_cast<const unsigned char*>(mapping);
+#endif
+    }
+
+    void unmapVideo(const unsigned char* data, std::size_t bytes)
+    {
+#ifdef _WIN32
+        (void)bytes;
+        UnmapViewOfFile(data);
+#else
+        munmap(const_cast<unsigned char*>(data), bytes);
+#endif
+    }
+
+    // Regular files are mapped, anything else, such as a named pipe, is read as a stream
+    bool isMappable(const std::string& fn)
+    {
+        std::error_code error;
+        return fn != kStandardInput && std::filesystem::is_regular_file(fn, error);
+    }
+
+    template <typename T>
+    T clampSample(std::int64_t value, int maxVal)
+    {
+        return static_cast<T>(std::min<std::int64_t>(std::max<std::int64_t>(value, 0), maxVal));
+    }
+}
+
+bool parseRawGeometry(const std::string& text, VideoFormat& format)
+{
+    int width = 0;
+    int height = 0;
+    int channels = 3;
+    char separator = 0;
+
+    std::istringstream fields(text);
+
+    if (!(fields >> width >> separator >> height) || separator != 'x')
+    {
+        return false;
+    }
+
+    if (fields >> separator)
+    {
+        if (separator != 'x' || !(fields >> channels))
+        {
+            return false;
+        }
+    }
+
+    if (width < 1 || height < 1 || channels < 3 || channels > 4)
+    {
+        return false;
+    }
+
+    format.width = width;
+    format.height = height;
+    format.channels = channels;
+    format.sampling = VideoSampling::Planar;
+
+    return true;
+}
+
+VideoFrameSource::VideoFrameSource(const VideoFormat& newFormat, std::size_t memoryBudget)
+    : videoFormat(newFormat)
+    , budget(memoryBudget)
+{
+    sampleBytes = sampleBytesOf(videoFormat);
+    payloadBytes = videoFrameBytes(videoFormat);
+    frameBytes = static_cast<std::size_t>(videoFormat.width) * videoFormat.height * videoFormat.channels * sampleBytes;
+}
+
+VideoFrameSource::~VideoFrameSource()
+{
+    if (mappedData)
+    {
+        unmapVideo(mappedData, mappedBytes);
+    }
+
+    if (scratch)
+    {
+        std::fclose(scratch);
+    }
+}
+
+std::unique_ptr<VideoFrameSource> VideoFrameSource::openY4m(const std::string& fn, std::size_t memoryBudget)
+{
+    VideoFormat format;
+    std::unique_ptr<VideoFrameSource> source;
+
+    if (isMappable(fn))
+    {
+        std::size_t bytes = 0;
+        const unsigned char* data = mapVideo(fn, bytes);
+
+        if (!data)
+        {
+            std::cerr << "Could not open video " << fn << "! Exiting." << std::endl;
+            exit(EXIT_FAILURE);
+        }
+
+        const unsigned char* headerEnd = static_cast<const unsigned char*>(std::memchr(data, '\n', std::min(bytes, kMaxHeaderBytes)));
+
+        if (!headerEnd || !parseY4mHeader(std::string(data, headerEnd), format))
+        {
+            unmapVideo(data, bytes);
+
+            std::cerr << "Invalid YUV4MPEG2 header in " << fn << "! Exiting." << std::endl;
+            exit(EXIT_FAILURE);
+        }
+
+        source.reset(new VideoFrameSource(format, memoryBudget));
+        source->mappedData = data;
+        source->mappedBytes = bytes;
+        source->indexFrames(static_cast<std::size_t>(headerEnd + 1 - data), true);
+    }
+    else
+    {
+        std::FILE* file = openStream(fn);
+        std::string line;
+
+        if (!readLine(file, line) || !parseY4mHeader(line, format))
+        {
+            std::cerr << "Invalid YUV4MPEG2 header in " << fn << "! Exiting." << std::endl;
+            exit(EXIT_FAILURE);
+        }
+
+        source.reset(new VideoFrameSource(format, memoryBudget));
+        source->readStream(file, true);
+
+        closeStream(file);
+    }
+
+    if (source->frames == 0)
+    {
+        std::cerr << "No frames found in video " << fn << "! Exiting." << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    return source;
+}
+
+std::unique_ptr<VideoFrameSource> VideoFrameSource::openRaw(const std::string& fn, const VideoFormat& format, std::size_t memoryBudget)
+{
+    std::unique_ptr<VideoFrameSource> source(new VideoFrameSource(format, memoryBudget));
+
+    if (isMappable(fn))
+    {
+        source->mappedData = mapVideo(fn, source->mappedBytes);
+
+        if (!source->mappedData)
+        {
+            std::cerr << "Could not open video " << fn << "! Exiting." << std::endl;
+            exit(EXIT_FAILURE);
+        }
+
+        source->indexFrames(0, false);
+    }
+    else
+    {
+        std::FILE* file = openStream(fn);
+        source->readStream(file, false);
+        closeStream(file);
+    }
+
+    if (source->frames == 0)
+    {
+        std::cerr << "No frames found in video " << fn << "! Exiting." << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    return source;
+}
+
+const VideoFormat& VideoFrameSource::format() const
+{
+    return videoFormat;
+}
+
+int VideoFrameSource::frameCount() const
+{
+    return frames;
+}
+
+// Find the frames of a mapped video, starting at the given offset.
+// A frame cut short at the end of the file is left out.
+void VideoFrameSource::indexFrames(std::size_t offset, bool y4m)
+{
+    while (offset < mappedBytes)
+    {
+        if (y4m)
+        {
+            std::size_t available = std::min(mappedBytes - offset, kMaxHeaderBytes);
+            const void* lineEnd = std::memchr(mappedData + offset, '\n', available);
+
+            if (available < kFrameMarkerBytes || std::memcmp(mappedData + offset, kFrameMarker, kFrameMarkerBytes) != 0 || !lineEnd)
+            {
+                std::cerr << "Invalid frame header in the video. Using the " << offsets.size() << " frames before it." << std::endl;
+                break;
+            }
+
+            offset = static_cast<const unsigned char*>(lineEnd) + 1 - mappedData;
+        }
+
+        if (mappedBytes - offset < payloadBytes)
+        {
+            std::cerr << "Incomplete last frame in the video. Using the " << offsets.size() << " frames before it." << std::endl;
+            break;
+        }
+
+        offsets.push_back(offset);
+        offset += payloadBytes;
+    }
+
+    frames = static_cast<int>(offsets.size());
+}
+
+// Read every frame of a stream. A frame cut short at the end of the stream is left out.
+void VideoFrameSource::readStream(std::FILE* file, bool y4m)
+{
+    std::vector<unsigned char> frame(payloadBytes);
+    std::string line;
+
+    while (true)
+    {
+        if (y4m)
+        {
+            if (!readLine(file, line))
+            {
+                break;
+            }
+
+            if (line.compare(0, kFrameMarkerBytes, kFrameMarker) != 0)
+            {
+                std::cerr << "Invalid frame header in the video. Using the " << frames << " frames before it." << std::endl;
+                break;
+            }
+        }
+
+        std::size_t read = std::fread(frame.data(), 1, payloadBytes, file);
+
+        if (read != payloadBytes)
+        {
+            if (read > 0 || y4m)
+            {
+                std::cerr << "Incomplete last frame in the video. Using the " << frames << " frames before it." << std::endl;
+            }
+
+            break;
+        }
+
+        storeFrame(frame);
+    }
+}
+
+// Keep a frame read from a stream, in memory while the budget lasts and in the scratch file after that
+void VideoFrameSource::storeFrame(const std::vector<unsigned char>& frame)
+{
+    if ((memory.size() + 1) * payloadBytes <= budget)
+    {
+        memory.push_back(frame);
+        frames++;
+        return;
+    }
+
+    if (!scratch)
+    {
+        scratch = std::tmpfile();
+
+        if (!scratch)
+        {
+            std::cerr << std::endl << "Failed to create the video scratch file. Exiting." << std::endl;
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (std::fwrite(frame.data(), 1, payloadBytes, scratch) != payloadBytes)
+    {
+        std::cerr << std::endl << "Failed to write the video scratch file. Exiting." << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    frames++;
+}
+
+// Samples of a frame as stored in the video, in the mapping, in memory or read into the buffer
+const unsigned char* VideoFrameSource::framePayload(int index, std::vector<unsigned char>& buffer)
+{
+    if (mappedData)
+    {
+        return mappedData + offsets[index];
+    }
+
+    if (index < static_cast<int>(memory.size()))
+    {
+        return memory[index].data();
+    }
+
+    buffer.resize(payloadBytes);
+
+    std::lock_guard<std::mutex> lock(scratchMutex);
+
+    std::size_t offset = static_cast<std::size_t>(index - memory.size()) * payloadBytes;
+
+#ifdef _WIN32
+    int result = _fseeki64(scratch, static_cast<long long>(offset), SEEK_SET);
+#else
+    int result = fseeko(scratch, static_cast<off_t>(offset), SEEK_SET);
+#endif
+
+    if (result != 0 || std::fread(buffer.data(), 1, payloadBytes, scratch) != payloadBytes)
+    {
+        std::cerr << std::endl << "Failed to read the video scratch file. Exiting." << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    return buffer.data();
+}
+
+// Planar frames are returned without copying unless they were spilled, YUV frames are converted into the buffer
+const unsigned char* VideoFrameSource::readFrame(int index, std::vector<unsigned char>& buffer)
+{
+    const unsigned char* payload = framePayload(index, buffer);
+
+    if (videoFormat.sampling == VideoSampling::Planar)
+    {
+        return payload;
+    }
+
+    // A spilled frame was read into the buffer, which now receives the converted frame
+    std::vector<unsigned char> spilled;
+
+    if (payload == buffer.data())
+    {
+        spilled.swap(buffer);
+    }
+
+    buffer.resize(frameBytes);
+
+    if (sampleBytes == 2)
+    {
+        convertFrame<std::uint16_t>(payload, buffer.data());
+    }
+    else
+    {
+        convertFrame<std::uint8_t>(payload, buffer.data());
+    }
+
+    return buffer.data();
+}
+
+// Bands of planar frames are cropped from the frame in place, without reading the other rows
+bool VideoFrameSource::readsRows() const
+{
+    return videoFormat.sampling == VideoSampling::Planar && !scratch;
+}
+
+// Convert a YUV or mono frame to planar RGB, upsampling the chroma planes to the full size
+template <typename T>
+void VideoFrameSource::convertFrame(const unsigned char* payload, unsigned char* frame) const
+{
+    int width = videoFormat.width;
+    int height = videoFormat.height;
+    std::size_t size = static_cast<std::size_t>(width) * height;
+
+    int chromaWidth = 0;
+    int chromaHeight = 0;
+    chromaSize(videoFormat, chromaWidth, chromaHeight);
+
+    const T* luma = reinterpret_cast<const T*>(payload);
+    const T* cb = luma + size;
+    const T* cr = cb + static_cast<std::size_t>(chromaWidth) * chromaHeight;
+
+    T* red = reinterpret_cast<T*>(frame);
+    T* green = red + size;
+    T* blue = green + size;
+
+    const YuvMatrix& matrix = videoFormat.fullRange ? kFullRange : kVideoRange;
+    int scale = 1 << (videoFormat.depth - 8);
+    int maxVal = (1 << videoFormat.depth) - 1;
+    int lumaOffset = videoFormat.fullRange ? 0 : 16 * scale;
+    int chromaOffset = 128 * scale;
+
+    bool halfWidth = videoFormat.sampling == VideoSampling::Yuv422 || videoFormat.sampling == VideoSampling::Yuv420;
+    bool halfHeight = videoFormat.sampling == VideoSampling::Yuv420;
+
+    for (int y = 0; y < height; y++)
+    {
+        std::size_t row = static_cast<std::size_t>(y) * width;
+        std::size_t chromaRow = static_cast<std::size_t>(halfHeight ? y / 2 : y) * chromaWidth;
+
+        for (int x = 0; x < width; x++)
+        {
+            std::size_t idx = row + x;
+            std::int64_t lumaPart = static_cast<std::int64_t>(luma[idx] - lumaOffset) * matrix.luma + kFixedHalf;
+
+            if (videoFormat.sampling == VideoSampling::Mono)
+            {
+                T gray = clampSample<T>(lumaPart >> kFixedShift, maxVal);
+
+                red[idx] = gray;
+                green[idx] = gray;
+                blue[idx] = gray;
+                continue;
+            }
+
+            std::size_t chroma = chromaRow + (halfWidth ? x / 2 : x);
+            std::int64_t u = static_cast<std::int64_t>(cb[chroma]) - chromaOffset;
+            std::int64_t v = static_cast<std::int64_t>(cr[chroma]) - chromaOffset;
+
+            red[idx] = clampSample<T>((lumaPart + matrix.crToR * v) >> kFixedShift, maxVal);
+            green[idx] = clampSample<T>((lumaPart - matrix.cbToG * u - matrix.crToG * v) >> kFixedShift, maxVal);
+            blue[idx] = clampSample<T>((lumaPart + matrix.cbToB * u) >> kFixedShift, maxVal);
+        }
+    }
+}
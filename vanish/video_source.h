@@ -0,0 +1,95 @@
+// VideoSource
+// Frames of an uncompressed video, YUV4MPEG2 or raw planar, read from a file or a pipe
+
+#pragma once
+
+#include <cstddef>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "frame_source.h"
+
+// Layout of the samples of a frame in the video
+// Planar frames are already in the layout of the frame sources, one plane per channel.
+// The YUV layouts have a full size luma plane followed by two chroma planes, which are
+// subsampled horizontally for 4:2:2 and in both directions for 4:2:0.
+enum class VideoSampling {
+    Planar,
+    Yuv444,
+    Yuv422,
+    Yuv420,
+    Mono
+};
+
+struct VideoFormat {
+    int width = 0;
+    int height = 0;
+    int depth = 8;
+    VideoSampling sampling = VideoSampling::Planar;
+
+    // Channels of planar frames, YUV and mono frames are converted to three RGB channels
+    int channels = 3;
+
+    // YUV samples use the whole range of the depth instead of the video range
+    bool fullRange = false;
+};
+
+// Parse the geometry of raw planar frames, given as WIDTHxHEIGHT or WIDTHxHEIGHTxCHANNELS.
+// Returns false if the text is not a valid geometry.
+bool parseRawGeometry(const std::string& text, VideoFormat& format);
+
+// Frames of a video stream. Regular files are mapped, so planar frames are read straight from
+// the mapping. Pipes and standard input can only be read once, their frames are read up front
+// and held in memory until the memory budget is used up, the rest are spilled to a scratch file.
+// YUV frames are converted to planar RGB on every read, with the BT.601 matrix.
+// Samples deeper than 8 bits take two bytes in the native byte order.
+class VideoFrameSource : public FrameSource {
+public:
+    ~VideoFrameSource();
+
+    // Open a YUV4MPEG2 video, "-" reads standard input. Exits if the video cannot be read.
+    static std::unique_ptr<VideoFrameSource> openY4m(const std::string& fn, std::size_t memoryBudget);
+
+    // Open a video of headerless planar frames of the given format
+    static std::unique_ptr<VideoFrameSource> openRaw(const std::string& fn, const VideoFormat& format, std::size_t memoryBudget);
+
+    // Format of the frames, with the channels of the converted frames
+    const VideoFormat& format() const;
+
+    int frameCount() const override;
+    const unsigned char* readFrame(int index, std::vector<unsigned char>& buffer) override;
+    bool readsRows() const override;
+
+private:
+    VideoFrameSource(const VideoFormat& videoFormat, std::size_t memoryBudget);
+
+    bool mapFile(const std::string& fn);
+    void indexFrames(std::size_t offset, bool y4m);
+    void readStream(std::FILE* file, bool y4m);
+    void storeFrame(const std::vector<unsigned char>& frame);
+
+    const unsigned char* framePayload(int index, std::vector<unsigned char>& buffer);
+
+    template <typename T>
+    void convertFrame(const unsigned char* payload, unsigned char* frame) const;
+
+    VideoFormat videoFormat;
+    int sampleBytes = 1;
+    std::size_t payloadBytes = 0;
+    std::size_t frameBytes = 0;
+    std::size_t budget = 0;
+    int frames = 0;
+
+    // Mapped file and the offsets of the frames in it
+    const unsigned char* mappedData = nullptr;
+    std::size_t mappedBytes = 0;
+    std::vector<std::size_t> offsets;
+
+    // Frames read from a pipe
+    std::vector<std::vector<unsigned char>> memory;
+    std::FILE* scratch = nullptr;
+    std::mutex scratchMutex;
+};